@@ -0,0 +1,315 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Host benchmark of the hot paths of the modbus, dsmr and loadbalancer libraries.
+// Usage: bench [filter]
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc16.h"
+#include "dsmr.h"
+#include "esmr5.h"
+#include "loadbalancer.h"
+#include "modbus_client.h"
+#include "modbus_server.h"
+
+#define BENCH_MIN_TIME_NS 200000000ULL
+
+struct bench {
+  const char* name;
+  void (*setup)(void);
+  void (*run)(void);
+  size_t bytes;  // Bytes processed per operation, 0 if not applicable
+};
+
+static volatile uint32_t sink;
+static uint32_t tick_ms;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t get_tick_ms(void) {
+  return tick_ms;
+}
+
+// CRC16
+
+static uint8_t crc_frame[MB_MAX_RTU_FRAME_SIZE];
+
+static void crc_setup(void) {
+  for (size_t i = 0; i < sizeof(crc_frame); i++) {
+    crc_frame[i] = (uint8_t)(i * 31 + 7);
+  }
+}
+
+static void crc_run_8(void) {
+  sink += mb_calc_crc16(crc_frame, 8);
+}
+
+static void crc_run_255(void) {
+  sink += mb_calc_crc16(crc_frame, 255);
+}
+
+static void crc_run_bitwise(void) {
+  sink += crc16_update_bitwise(0xFFFF, crc_frame, sizeof(crc_frame));
+}
+
+static void crc_run_nibble(void) {
+  sink += crc16_update_nibble(0xFFFF, crc_frame, sizeof(crc_frame));
+}
+
+static void crc_run_table(void) {
+  sink += crc16_update_table(0xFFFF, crc_frame, sizeof(crc_frame));
+}
+
+static void crc_run_slice4(void) {
+  sink += crc16_update_slice4(0xFFFF, crc_frame, sizeof(crc_frame));
+}
+
+static int crc_verify(void) {
+  crc_setup();
+  for (size_t len = 0; len <= sizeof(crc_frame); len++) {
+    uint16_t expected = crc16_update_bitwise(0xFFFF, crc_frame, len);
+    if (crc16_update_nibble(0xFFFF, crc_frame, len) != expected ||
+        crc16_update_table(0xFFFF, crc_frame, len) != expected ||
+        crc16_update_slice4(0xFFFF, crc_frame, len) != expected ||
+        mb_calc_crc16(crc_frame, len) != __builtin_bswap16(expected)) {
+      fprintf(stderr, "CRC16 engines disagree at length %zu\n", len);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// DSMR
+
+static void dsmr_telegram(const struct dsmr_telegram* telegram) {
+  sink += telegram->present + telegram->values[MSG_CURRENT_L1];
+}
+
+static void dsmr_forward(char* data, size_t len) {
+  (void)data;
+  sink += len;
+}
+
+static void dsmr_setup(void) {
+  struct dsmr_cb cb = {
+      .telegram = dsmr_telegram,
+      .forward = dsmr_forward,
+  };
+  dsmr_init(&cb);
+}
+
+static void dsmr_run(void) {
+  // The receive buffer is smaller than a telegram, so feed it in chunks like the UART would
+  const size_t len = sizeof(ESMR5_TELEGRAM) - 1;
+  for (size_t pos = 0; pos < len;) {
+    for (size_t chunk = 0; chunk < DSMR_RX_BUF_SIZE && pos < len; chunk++) {
+      dsmr_rx(ESMR5_TELEGRAM[pos++]);
+    }
+    dsmr_task();
+  }
+}
+
+static int dsmr_verify(void) {
+  dsmr_setup();
+  dsmr_run();
+  if (dsmr_get_stats()->telegrams != 1 || dsmr_get_stats()->crc_errors) {
+    fprintf(stderr, "Telegram not accepted\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Modbus server: read 10 holding registers
+
+static struct mb_server_context server_ctx;
+static uint8_t server_request[] = {10, MB_READ_HOLDING_REGISTERS, 0x03, 0xE8, 0x00, 0x0A, 0x00, 0x00};
+
+static enum mb_result server_read_holding_registers(uint16_t start, uint16_t count) {
+  for (int i = 0; i < count; i++) {
+    mb_server_add_response(&server_ctx, start + i);
+  }
+  return MB_NO_ERROR;
+}
+
+static void server_tx(uint8_t* data, size_t len) {
+  sink += data[len - 1];
+}
+
+static void server_setup(void) {
+  struct mb_server_cb cb = {
+      .get_tick_ms = get_tick_ms,
+      .tx = server_tx,
+      .read_holding_registers = server_read_holding_registers,
+  };
+  mb_server_init(&server_ctx, 10, &cb);
+
+  uint16_t crc = mb_calc_crc16(server_request, sizeof(server_request) - 2);
+  server_request[sizeof(server_request) - 2] = crc >> 8;
+  server_request[sizeof(server_request) - 1] = crc & 0xFF;
+}
+
+static void server_run(void) {
+  for (size_t i = 0; i < sizeof(server_request); i++) {
+    mb_server_rx(&server_ctx, server_request[i]);
+  }
+  mb_server_task(&server_ctx);
+}
+
+static void server_run_idle(void) {
+  mb_server_task(&server_ctx);
+}
+
+// Modbus client: read 10 holding registers
+
+static struct mb_client_context client_ctx;
+static uint8_t client_response[5 + 10 * 2];
+
+static void client_read_holding_registers(uint8_t address, uint16_t start, uint16_t count, uint16_t* data) {
+  (void)address;
+  (void)start;
+  sink += data[count - 1];
+}
+
+static void client_tx(uint8_t* data, size_t len) {
+  (void)data;
+  sink += len;
+}
+
+static void client_setup(void) {
+  struct mb_client_cb cb = {
+      .get_tick_ms = get_tick_ms,
+      .tx = client_tx,
+      .read_holding_registers = client_read_holding_registers,
+      .read_input_registers = client_read_holding_registers,
+  };
+  mb_client_init(&client_ctx, &cb);
+
+  client_response[0] = 0x01;
+  client_response[1] = MB_READ_HOLDING_REGISTERS;
+  client_response[2] = 10 * 2;
+  for (int i = 0; i < 10 * 2; i++) {
+    client_response[3 + i] = i;
+  }
+  uint16_t crc = mb_calc_crc16(client_response, sizeof(client_response) - 2);
+  client_response[sizeof(client_response) - 2] = crc >> 8;
+  client_response[sizeof(client_response) - 1] = crc & 0xFF;
+}
+
+static void client_run(void) {
+  mb_client_read_holding_registers(&client_ctx, 0x01, 0x4000, 10);
+  mb_client_task(&client_ctx);  // Send the request
+  for (size_t i = 0; i < sizeof(client_response); i++) {
+    mb_client_rx(&client_ctx, client_response[i]);
+  }
+  mb_client_task(&client_ctx);  // Handle the response
+}
+
+static void client_run_idle(void) {
+  mb_client_task(&client_ctx);
+}
+
+// Load balancer: one control step per call
+
+static struct lb_config lb_bench_config = {.charger_limit = 16000,
+                                           .number_of_phases = 3,
+                                           .alarm_limit = 24000,
+                                           .alarm_limit_wait_time = 1,
+                                           .alarm_limit_change_amount = 12500,
+                                           .upper_limit = 22000,
+                                           .upper_limit_wait_time = 5,
+                                           .upper_limit_change_amount = 1000,
+                                           .lower_limit = 19000,
+                                           .lower_limit_wait_time = 5,
+                                           .lower_limit_change_amount = 1000,
+                                           .fallback_limit = 0,
+                                           .fallback_limit_wait_time = 30,
+                                           .number_of_chargers = 3,
+                                           .policy = LB_POLICY_EQUAL,
+                                           .charger_min_current = 6000,
+                                           .chargers = {{.phase_map = LB_PHASE_MAP_DEFAULT},
+                                                        {.phase_map = LB_PHASE_MAP_DEFAULT},
+                                                        {.phase_map = LB_PHASE_MAP_DEFAULT}}};
+static struct lb_context lb_ctx;
+static uint32_t lb_now;
+
+static void lb_limit_charger(struct lb_context* ctx, uint8_t charger, uint16_t current) {
+  (void)ctx;
+  sink += charger + current;
+}
+
+static void lb_setup(void) {
+  lb_init(&lb_ctx, &lb_bench_config, lb_limit_charger);
+  lb_now = 1;
+}
+
+static void lb_run(void) {
+  // Sweep the grid current through all the bands
+  uint16_t grid = 15000 + (lb_now / 1001 % 100) * 100;
+  lb_set_grid_current(&lb_ctx, LB_PHASE_1, grid);
+  lb_set_grid_current(&lb_ctx, LB_PHASE_2, grid / 2);
+  lb_set_grid_current(&lb_ctx, LB_PHASE_3, grid / 3);
+  lb_now += 1001;  // Just over the check interval
+  lb_task(&lb_ctx, lb_now);
+}
+
+static const struct bench benches[] = {
+    {"crc16/8", crc_setup, crc_run_8, 8},
+    {"crc16/255", crc_setup, crc_run_255, 255},
+    {"crc16/bitwise/256", crc_setup, crc_run_bitwise, sizeof(crc_frame)},
+    {"crc16/nibble/256", crc_setup, crc_run_nibble, sizeof(crc_frame)},
+    {"crc16/table/256", crc_setup, crc_run_table, sizeof(crc_frame)},
+    {"crc16/slice4/256", crc_setup, crc_run_slice4, sizeof(crc_frame)},
+    {"dsmr/esmr5_telegram", dsmr_setup, dsmr_run, sizeof(ESMR5_TELEGRAM) - 1},
+    {"mb_server/read_10", server_setup, server_run, sizeof(server_request)},
+    {"mb_server/idle", server_setup, server_run_idle, 0},
+    {"mb_client/read_10", client_setup, client_run, sizeof(client_response)},
+    {"mb_client/idle", client_setup, client_run_idle, 0},
+    {"lb/check", lb_setup, lb_run, 0},
+};
+
+static void bench_run(const struct bench* b) {
+  uint64_t iterations = 1;
+  uint64_t elapsed;
+
+  b->setup();
+  for (;;) {
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+      b->run();
+    }
+    elapsed = now_ns() - start;
+    if (elapsed >= BENCH_MIN_TIME_NS) {
+      break;
+    }
+    iterations *= 2;
+  }
+
+  double ns_per_op = (double)elapsed / iterations;
+  printf("%-24s %12llu %12.1f ns/op", b->name, (unsigned long long)iterations, ns_per_op);
+  if (b->bytes) {
+    printf(" %12.1f MB/s", b->bytes * 1000.0 / ns_per_op);
+  }
+  printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+  const char* filter = argc > 1 ? argv[1] : NULL;
+
+  if (crc_verify() || dsmr_verify()) {
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    if (filter == NULL || strstr(benches[i].name, filter)) {
+      bench_run(&benches[i]);
+    }
+  }
+  return 0;
+}
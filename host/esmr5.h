@@ -0,0 +1,47 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#pragma once
+
+// Same telegram as utils/dsmr_sim.py (Sagemcom XS210, ESMR 5.0)
+static const char ESMR5_TELEGRAM[] =
+    "/Ene5\\T210-D ESMR5.0\r\n"
+    "\r\n"
+    "1-3:0.2.8(50)\r\n"
+    "0-0:1.0.0(230107170525W)\r\n"
+    "0-0:96.1.1(4530303438303030303332303631353139)\r\n"
+    "1-0:1.8.1(006184.667*kWh)\r\n"
+    "1-0:1.8.2(004762.136*kWh)\r\n"
+    "1-0:2.8.1(004708.286*kWh)\r\n"
+    "1-0:2.8.2(011405.268*kWh)\r\n"
+    "0-0:96.14.0(0001)\r\n"
+    "1-0:1.7.0(00.258*kW)\r\n"
+    "1-0:2.7.0(00.000*kW)\r\n"
+    "0-0:96.7.21(00082)\r\n"
+    "0-0:96.7.9(00021)\r\n"
+    "1-0:99.97.0(7)(0-0:96.7.19)(220416174436S)(0000001183*s)(220409124204S)(0000002103*s)(200713153049S)"
+    "(0000000977*s)(190621075419S)(0000003647*s)(190409135249S)(0000040586*s)(190409023338S)(0000003752*s)"
+    "(190316164111W)(0000000303*s)\r\n"
+    "1-0:32.32.0(00007)\r\n"
+    "1-0:52.32.0(00007)\r\n"
+    "1-0:72.32.0(00007)\r\n"
+    "1-0:32.36.0(00000)\r\n"
+    "1-0:52.36.0(00000)\r\n"
+    "1-0:72.36.0(00000)\r\n"
+    "0-0:96.13.0()\r\n"
+    "1-0:32.7.0(234.0*V)\r\n"
+    "1-0:52.7.0(236.0*V)\r\n"
+    "1-0:72.7.0(236.0*V)\r\n"
+    "1-0:31.7.0(001*A)\r\n"
+    "1-0:51.7.0(001*A)\r\n"
+    "1-0:71.7.0(000*A)\r\n"
+    "1-0:21.7.0(00.098*kW)\r\n"
+    "1-0:41.7.0(00.159*kW)\r\n"
+    "1-0:61.7.0(00.000*kW)\r\n"
+    "1-0:22.7.0(00.000*kW)\r\n"
+    "1-0:42.7.0(00.000*kW)\r\n"
+    "1-0:62.7.0(00.000*kW)\r\n"
+    "0-1:24.1.0(003)\r\n"
+    "0-1:96.1.0(4730303539303033383434303238393139)\r\n"
+    "0-1:24.2.1(230107170500W)(03133.361*m3)\r\n"
+    "!824A\r\n";
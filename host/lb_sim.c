@@ -0,0 +1,657 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Load balancer simulation in virtual time. A scenario gives the household load on each phase every second. The
+// vehicles' draw is added to it, the result is written as a meter telegram and goes through the dsmr parser and the
+// load balancer like on the device. The vehicles follow their limit VEHICLE_LAG_MS late.
+//
+// Usage: lb_sim [-s scenario] [-r capture] [-t seconds] [-n chargers] [-c source] [-f] [-p field=from:to:step]
+//               [-j jobs]
+//   -s  step, ramp, noise or drop, all of them by default
+//   -r  replay a P1 capture instead, one telegram per second, its load is taken as the household load
+//   -t  length of the generated scenarios, 4 hours by default
+//   -n  number of chargers, each with a vehicle that takes up to 16 A on three phases
+//   -c  grid current source (enum dsmr_current_source), 2 by default
+//   -f  feed the charger currents back to the load balancer every second
+//   -p  sweep a field of struct lb_config, up to SIM_MAX_SWEEPS times for every combination
+//   -j  worker processes, one per core by default
+//
+// The dsmr parser keeps its state in statics, so the runs are spread over worker processes instead of threads.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc16.h"
+#include "dsmr.h"
+#include "loadbalancer.h"
+
+#define SIM_TICK_MS        100  // Main loop resolution
+#define SIM_TELEGRAM_MS    1000
+#define SIM_DEFAULT_TIME   (4 * 3600)
+#define SIM_MAX_SWEEPS     4
+#define SIM_MAX_SCENARIOS  5
+#define SIM_VOLTAGE        230000  // mV
+#define SIM_GRID_LIMIT     25000   // mA, the fuse
+#define VEHICLE_LAG_MS     2000
+#define VEHICLE_MAX        16000  // mA
+#define VEHICLE_LAG_TICKS  (VEHICLE_LAG_MS / SIM_TICK_MS)
+
+// What happens to the telegram of a second
+#define SIM_SENT    0
+#define SIM_DROPPED 1  // Not sent at all
+#define SIM_CORRUPT 2  // Sent with a wrong CRC
+
+struct sim_load {
+  int32_t current[3];  // mA, household, negative when returning power
+  int32_t voltage[3];  // mV
+  uint8_t telegram;  // SIM_*
+};
+
+struct sim_scenario {
+  const char* name;
+  struct sim_load* loads;  // One per second
+  uint32_t count;
+};
+
+struct sim_field {
+  const char* name;
+  size_t offset;
+  size_t size;
+};
+
+struct sim_sweep {
+  const struct sim_field* field;
+  int32_t from;
+  int32_t to;
+  int32_t step;
+  uint32_t count;
+};
+
+struct sim_result {
+  double overcurrent;  // s a phase was over the fuse, summed over the phases
+  double energy;  // kWh delivered to the vehicles
+  uint32_t writes;  // Charger limits changed
+  uint32_t latency_count;  // Overloads the load balancer reacted on
+  uint64_t latency_sum;  // ms
+  uint32_t latency_max;  // ms
+  uint32_t telegrams;  // Accepted by the parser
+  uint32_t expected;  // Sent with a valid CRC
+  int32_t peak;  // W, highest quarter-hour average once the load balancer has seen a full quarter-hour
+};
+
+#define SIM_FIELD(name) {#name, offsetof(struct lb_config, name), sizeof(((struct lb_config*)0)->name)}
+
+static const struct sim_field sim_fields[] = {
+    SIM_FIELD(charger_limit),
+    SIM_FIELD(alarm_limit),
+    SIM_FIELD(alarm_limit_wait_time),
+    SIM_FIELD(alarm_limit_change_amount),
+    SIM_FIELD(upper_limit),
+    SIM_FIELD(upper_limit_wait_time),
+    SIM_FIELD(upper_limit_change_amount),
+    SIM_FIELD(lower_limit),
+    SIM_FIELD(lower_limit_wait_time),
+    SIM_FIELD(lower_limit_change_amount),
+    SIM_FIELD(fallback_limit),
+    SIM_FIELD(fallback_limit_wait_time),
+    SIM_FIELD(policy),
+    SIM_FIELD(charger_min_current),
+    SIM_FIELD(trigger),
+    SIM_FIELD(controller),
+    SIM_FIELD(pi_kp),
+    SIM_FIELD(pi_ki),
+    SIM_FIELD(pi_kd),
+    SIM_FIELD(demand_limit),
+};
+
+// The firmware defaults
+static struct lb_config sim_config = {
+    .charger_limit = 16000,
+    .number_of_phases = 3,
+    .alarm_limit = 24000,
+    .alarm_limit_wait_time = 1,
+    .alarm_limit_change_amount = 12500,
+    .upper_limit = 22000,
+    .upper_limit_wait_time = 5,
+    .upper_limit_change_amount = 1000,
+    .lower_limit = 19000,
+    .lower_limit_wait_time = 5,
+    .lower_limit_change_amount = 1000,
+    .fallback_limit = 0,
+    .fallback_limit_wait_time = 30,
+    .number_of_chargers = 1,
+    .policy = LB_POLICY_EQUAL,
+    .charger_min_current = 6000,
+    .trigger = LB_TRIGGER_GRID_UPDATE,
+    .controller = LB_CONTROLLER_HYSTERESIS,
+    .pi_kp = 100,
+    .pi_ki = 200,
+    .pi_kd = 500,
+};
+
+static struct sim_scenario scenarios[SIM_MAX_SCENARIOS];
+static uint8_t scenario_count;
+static struct sim_sweep sweeps[SIM_MAX_SWEEPS];
+static uint8_t sweep_count;
+static enum dsmr_current_source current_source = DSMR_CURRENT_FUSED;
+static bool feedback;
+static uint32_t seed;
+
+// State of the run in this process
+static struct lb_context lb_ctx;
+static struct sim_result* result;
+static uint32_t now;  // ms
+static uint16_t limit[LB_MAX_CHARGERS];  // As written to the chargers
+static bool overload;  // A phase is over the upper limit and the load balancer did not lower a limit yet
+static uint32_t overload_time;
+
+static uint32_t sim_random(uint32_t range) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % range;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Scenarios
+
+static struct sim_load* scenario_add(const char* name, uint32_t count) {
+  struct sim_scenario* scenario = &scenarios[scenario_count++];
+
+  scenario->name = name;
+  scenario->count = count;
+  scenario->loads = calloc(count, sizeof(struct sim_load));
+  for (uint32_t s = 0; s < count; s++) {
+    for (int phase = 0; phase < 3; phase++) {
+      scenario->loads[s].voltage[phase] = SIM_VOLTAGE;
+    }
+  }
+  return scenario->loads;
+}
+
+// An appliance of 12 A switches on for five minutes every quarter, on the next phase each time
+static void scenario_step(uint32_t count) {
+  struct sim_load* loads = scenario_add("step", count);
+
+  for (uint32_t s = 0; s < count; s++) {
+    for (int phase = 0; phase < 3; phase++) {
+      loads[s].current[phase] = 2000 + phase * 500;
+    }
+    if (s % 900 >= 300 && s % 900 < 600) {
+      loads[s].current[s / 900 % 3] += 12000;
+    }
+  }
+}
+
+// A heat pump ramps up to 10 A on all phases in 20 minutes, runs for 20 minutes and ramps down again
+static void scenario_ramp(uint32_t count) {
+  struct sim_load* loads = scenario_add("ramp", count);
+
+  for (uint32_t s = 0; s < count; s++) {
+    uint32_t t = s % 3600;
+    int32_t heat_pump = t < 1200 ? t * 10000 / 1200 : t < 2400 ? 10000 : (3600 - t) * 10000 / 1200;
+    for (int phase = 0; phase < 3; phase++) {
+      loads[s].current[phase] = 1500 + heat_pump;
+    }
+  }
+}
+
+// A wandering load with up to 1.5 A noise on the current and 3 V on the voltage
+static struct sim_load* generate_noise(const char* name, uint32_t count) {
+  struct sim_load* loads = scenario_add(name, count);
+  int32_t base[3] = {4000, 3000, 2000};
+
+  for (uint32_t s = 0; s < count; s++) {
+    for (int phase = 0; phase < 3; phase++) {
+      base[phase] += (int32_t)sim_random(401) - 200;
+      base[phase] = base[phase] < 500 ? 500 : base[phase] > 9000 ? 9000 : base[phase];
+      loads[s].current[phase] = base[phase] + (int32_t)sim_random(3001) - 1500;
+      loads[s].voltage[phase] = SIM_VOLTAGE + ((int32_t)sim_random(61) - 30) * 100;
+    }
+  }
+  return loads;
+}
+
+static void scenario_noise(uint32_t count) {
+  generate_noise("noise", count);
+}
+
+// The noise with telegrams lost for up to a minute and now and then one with a bad CRC
+static void scenario_drop(uint32_t count) {
+  struct sim_load* loads = generate_noise("drop", count);
+
+  for (uint32_t s = 0; s < count; s++) {
+    if (sim_random(200) == 0) {
+      for (uint32_t end = s + 1 + sim_random(60); s < end && s < count; s++) {
+        loads[s].telegram = SIM_DROPPED;
+      }
+    } else if (sim_random(100) == 0) {
+      loads[s].telegram = SIM_CORRUPT;
+    }
+  }
+}
+
+static void capture_telegram(const struct dsmr_telegram* telegram) {
+  struct sim_scenario* scenario = &scenarios[scenario_count - 1];
+  struct sim_load load = {.telegram = SIM_SENT};
+
+  for (int phase = 0; phase < 3; phase++) {
+    if (dsmr_phase_current(telegram, phase, DSMR_CURRENT_POWER, &load.current[phase])) {
+      dsmr_phase_current(telegram, phase, DSMR_CURRENT_METER, &load.current[phase]);
+    }
+    bool has_voltage = telegram->present & (1UL << (MSG_VOLTAGE_L1 + phase));
+    load.voltage[phase] = has_voltage ? telegram->values[MSG_VOLTAGE_L1 + phase] : SIM_VOLTAGE;
+  }
+  scenario->loads = realloc(scenario->loads, (scenario->count + 1) * sizeof(struct sim_load));
+  scenario->loads[scenario->count++] = load;
+}
+
+static int scenario_capture(const char* path) {
+  struct dsmr_cb cb = {.telegram = capture_telegram};
+  char buf[DSMR_RX_BUF_SIZE];
+  size_t len;
+  FILE* f = fopen(path, "rb");
+
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  scenarios[scenario_count++] = (struct sim_scenario){.name = path};
+  dsmr_init(&cb);
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+    for (size_t i = 0; i < len; i++) {
+      dsmr_rx(buf[i]);
+    }
+    dsmr_task();
+  }
+  fclose(f);
+  if (scenarios[scenario_count - 1].count == 0) {
+    fprintf(stderr, "%s: no valid telegrams\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+// Meter
+
+static int telegram_print(char* p, size_t size, const int32_t* current, const int32_t* voltage, bool corrupt) {
+  static const char* const obis[3][4] = {
+      {"32.7.0", "31.7.0", "21.7.0", "22.7.0"},
+      {"52.7.0", "51.7.0", "41.7.0", "42.7.0"},
+      {"72.7.0", "71.7.0", "61.7.0", "62.7.0"},
+  };
+  int len = snprintf(p, size, "/Ene5\\T210-D ESMR5.0\r\n\r\n1-3:0.2.8(50)\r\n");
+
+  for (int phase = 0; phase < 3; phase++) {
+    int32_t power = (int32_t)((int64_t)current[phase] * voltage[phase] / 1000000);  // W
+    int32_t amps = (current[phase] < 0 ? -current[phase] : current[phase]) / 1000;  // The meter truncates
+    int32_t import = power > 0 ? power : 0;
+    int32_t export = power < 0 ? -power : 0;
+    len += snprintf(p + len, size - len,
+                    "1-0:%s(%03d.%d*V)\r\n1-0:%s(%03d*A)\r\n1-0:%s(%02d.%03d*kW)\r\n1-0:%s(%02d.%03d*kW)\r\n",
+                    obis[phase][0], voltage[phase] / 1000, voltage[phase] % 1000 / 100, obis[phase][1], amps,
+                    obis[phase][2], import / 1000, import % 1000, obis[phase][3], export / 1000, export % 1000);
+  }
+  len += snprintf(p + len, size - len, "!");
+  uint16_t crc = crc16_update(0, (const uint8_t*)p, len) ^ (corrupt ? 1 : 0);
+  return len + snprintf(p + len, size - len, "%04X\r\n", crc);
+}
+
+static void meter_send(const int32_t* current, const int32_t* voltage, bool corrupt) {
+  char telegram[512];
+  int len = telegram_print(telegram, sizeof(telegram), current, voltage, corrupt);
+
+  for (int i = 0; i < len; i++) {
+    dsmr_rx(telegram[i]);
+  }
+  dsmr_task();
+}
+
+// Like dsmr_update() in the firmware
+static void sim_telegram(const struct dsmr_telegram* telegram) {
+  int32_t current;
+  int32_t power;
+  bool updated = false;
+
+  result->telegrams++;
+  for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+    if (!dsmr_phase_current(telegram, phase, current_source, &current)) {
+      lb_set_grid_current(&lb_ctx, phase, current);
+      updated = true;
+    }
+    if (!dsmr_phase_power(telegram, phase, &power)) {
+      lb_set_grid_power(&lb_ctx, phase, power);
+    }
+  }
+  if (updated) {
+    lb_commit_grid_current(&lb_ctx, now);
+  }
+}
+
+static void limit_charger(struct lb_context* ctx, uint8_t charger, uint16_t current) {
+  (void)ctx;
+  if (current == limit[charger]) {
+    return;
+  }
+  if (overload && current < limit[charger]) {
+    uint32_t latency = now - overload_time;
+    result->latency_count++;
+    result->latency_sum += latency;
+    result->latency_max = latency > result->latency_max ? latency : result->latency_max;
+    overload = false;
+  }
+  limit[charger] = current;
+  result->writes++;
+}
+
+// Runs
+
+static uint32_t sweep_combinations(void) {
+  uint32_t combinations = 1;
+  for (uint8_t i = 0; i < sweep_count; i++) {
+    combinations *= sweeps[i].count;
+  }
+  return combinations;
+}
+
+// Value of every swept field for combination n, the first sweep changes slowest
+static void sweep_values(uint32_t n, int32_t* values) {
+  for (int i = sweep_count - 1; i >= 0; i--) {
+    values[i] = sweeps[i].from + (int32_t)(n % sweeps[i].count) * sweeps[i].step;
+    n /= sweeps[i].count;
+  }
+}
+
+static void sim_run(const struct sim_scenario* scenario, uint32_t combination, struct sim_result* run_result) {
+  struct dsmr_cb cb = {.telegram = sim_telegram};
+  struct lb_config config = sim_config;
+  uint16_t history[LB_MAX_CHARGERS][VEHICLE_LAG_TICKS] = {{0}};  // Written limits, the vehicles follow them late
+  int32_t values[SIM_MAX_SWEEPS];
+  int32_t threshold = sim_config.upper_limit;  // The same for every combination
+  bool over = false;
+
+  sweep_values(combination, values);
+  for (uint8_t i = 0; i < sweep_count; i++) {
+    uint8_t* field = (uint8_t*)&config + sweeps[i].field->offset;
+    if (sweeps[i].field->size == 1) {
+      *field = values[i];
+    } else {
+      *(uint16_t*)field = values[i];
+    }
+  }
+
+  result = run_result;
+  memset(result, 0, sizeof(*result));
+  memset(limit, 0, sizeof(limit));
+  overload = false;
+  dsmr_init(&cb);
+  lb_init(&lb_ctx, &config, limit_charger);
+
+  for (uint32_t tick = 0; tick < scenario->count * (SIM_TELEGRAM_MS / SIM_TICK_MS); tick++) {
+    const struct sim_load* load = &scenario->loads[tick / (SIM_TELEGRAM_MS / SIM_TICK_MS)];
+    int32_t grid[3];
+    int32_t draw[LB_MAX_CHARGERS];
+    int32_t grid_max = INT32_MIN;
+
+    now = tick * SIM_TICK_MS;
+    memcpy(grid, load->current, sizeof(grid));
+    for (uint8_t i = 0; i < config.number_of_chargers; i++) {
+      uint16_t vehicle_limit = history[i][tick % VEHICLE_LAG_TICKS];
+      draw[i] = vehicle_limit < VEHICLE_MAX ? vehicle_limit : VEHICLE_MAX;
+      for (int c = 0; c < 3; c++) {
+        enum lb_phase phase = LB_PHASE_MAP_GET(config.chargers[i].phase_map, c);
+        if (phase != LB_PHASE_NONE) {
+          grid[phase] += draw[i];
+          result->energy += (double)draw[i] * load->voltage[phase] * SIM_TICK_MS / 3.6e15;  // mA * mV * ms -> kWh
+        }
+      }
+    }
+    for (int phase = 0; phase < 3; phase++) {
+      if (grid[phase] > SIM_GRID_LIMIT) {
+        result->overcurrent += SIM_TICK_MS / 1000.0;
+      }
+      grid_max = grid[phase] > grid_max ? grid[phase] : grid_max;
+    }
+
+    // The latency runs from the moment a phase goes over the upper limit to the first lowered limit
+    if (grid_max > threshold && !over) {
+      overload = true;
+      overload_time = now;
+    } else if (grid_max <= threshold) {
+      overload = false;
+    }
+    over = grid_max > threshold;
+
+    if (now % SIM_TELEGRAM_MS == 0) {
+      if (feedback) {
+        for (uint8_t i = 0; i < config.number_of_chargers; i++) {
+          for (int c = 0; c < 3; c++) {
+            bool connected = LB_PHASE_MAP_GET(config.chargers[i].phase_map, c) != LB_PHASE_NONE;
+            lb_set_charger_current(&lb_ctx, i, c, connected ? draw[i] : 0);
+          }
+        }
+      }
+      if (load->telegram != SIM_DROPPED) {
+        result->expected += load->telegram == SIM_SENT;
+        meter_send(grid, load->voltage, load->telegram == SIM_CORRUPT);
+      }
+      if (lb_ctx.demand.filled == LB_DEMAND_SECONDS) {
+        int32_t average = lb_get_average_power(&lb_ctx, LB_WINDOW_15MIN, LB_PHASE_NONE);
+        result->peak = average > result->peak ? average : result->peak;
+      }
+    }
+
+    lb_task(&lb_ctx, now);
+    for (uint8_t i = 0; i < config.number_of_chargers; i++) {
+      history[i][tick % VEHICLE_LAG_TICKS] = limit[i];
+    }
+  }
+}
+
+// Every worker takes every jobs-th run, the results go to memory shared with the parent
+static int sim_run_all(struct sim_result* results, uint32_t runs, long jobs) {
+  uint32_t combinations = sweep_combinations();
+
+  for (long job = 0; job < jobs; job++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return -1;
+    }
+    if (pid == 0) {
+      for (uint32_t n = job; n < runs; n += jobs) {
+        sim_run(&scenarios[n / combinations], n % combinations, &results[n]);
+      }
+      _exit(0);
+    }
+  }
+
+  int failed = 0;
+  int status;
+  while (wait(&status) > 0) {
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+  }
+  return failed ? -1 : 0;
+}
+
+// Command line
+
+static int parse_sweep(char* arg) {
+  struct sim_sweep* sweep = &sweeps[sweep_count];
+  char* value = strchr(arg, '=');
+
+  if (sweep_count == SIM_MAX_SWEEPS || value == NULL) {
+    return -1;
+  }
+  *value++ = 0;
+  for (size_t i = 0; i < sizeof(sim_fields) / sizeof(sim_fields[0]); i++) {
+    if (strcmp(sim_fields[i].name, arg) == 0) {
+      sweep->field = &sim_fields[i];
+    }
+  }
+  if (sweep->field == NULL) {
+    fprintf(stderr, "Unknown field %s\n", arg);
+    return -1;
+  }
+  int n = sscanf(value, "%d:%d:%d", &sweep->from, &sweep->to, &sweep->step);
+  if (n < 1) {
+    return -1;
+  }
+  if (n < 2) {
+    sweep->to = sweep->from;
+  }
+  if (n < 3 || sweep->step <= 0) {
+    sweep->step = 1;
+  }
+  if (sweep->to < sweep->from) {
+    return -1;
+  }
+  sweep->count = (sweep->to - sweep->from) / sweep->step + 1;
+  sweep_count++;
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: lb_sim [-s scenario] [-r capture] [-t seconds] [-n chargers] [-c source] [-f] "
+          "[-p field=from:to:step] [-j jobs]\n");
+}
+
+int main(int argc, char* argv[]) {
+  const char* scenario = NULL;
+  const char* capture = NULL;
+  uint32_t seconds = SIM_DEFAULT_TIME;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:r:t:n:c:fp:j:")) != -1) {
+    switch (opt) {
+      case 's':
+        scenario = optarg;
+        break;
+      case 'r':
+        capture = optarg;
+        break;
+      case 't':
+        seconds = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        sim_config.number_of_chargers = strtoul(optarg, NULL, 10);
+        break;
+      case 'c':
+        current_source = strtoul(optarg, NULL, 10);
+        break;
+      case 'f':
+        feedback = true;
+        break;
+      case 'p':
+        if (parse_sweep(optarg)) {
+          usage();
+          return 2;
+        }
+        break;
+      case 'j':
+        jobs = strtol(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+  if (sim_config.number_of_chargers < 1 || sim_config.number_of_chargers > LB_MAX_CHARGERS ||
+      current_source >= DSMR_CURRENT_LAST || seconds == 0) {
+    usage();
+    return 2;
+  }
+  for (uint8_t i = 0; i < LB_MAX_CHARGERS; i++) {
+    sim_config.chargers[i].phase_map = LB_PHASE_MAP_DEFAULT;
+  }
+
+  if (capture) {
+    if (scenario_capture(capture)) {
+      return 1;
+    }
+  } else {
+    static const struct {
+      const char* name;
+      void (*generate)(uint32_t count);
+    } generators[] = {
+        {"step", scenario_step},
+        {"ramp", scenario_ramp},
+        {"noise", scenario_noise},
+        {"drop", scenario_drop},
+    };
+
+    seed = 2022;
+    for (size_t i = 0; i < sizeof(generators) / sizeof(generators[0]); i++) {
+      if (scenario == NULL || strcmp(scenario, generators[i].name) == 0) {
+        generators[i].generate(seconds);
+      }
+    }
+    if (scenario_count == 0) {
+      fprintf(stderr, "Unknown scenario %s\n", scenario);
+      return 2;
+    }
+  }
+
+  uint32_t runs = scenario_count * sweep_combinations();
+  struct sim_result* results =
+      mmap(NULL, runs * sizeof(struct sim_result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+  if (jobs > (long)runs) {
+    jobs = runs;
+  }
+
+  uint64_t start = now_ns();
+  if (sim_run_all(results, runs, jobs)) {
+    return 1;
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  printf("%-10s", "scenario");
+  for (uint8_t i = 0; i < sweep_count; i++) {
+    printf(" %*s", (int)strlen(sweeps[i].field->name) > 6 ? (int)strlen(sweeps[i].field->name) : 6,
+           sweeps[i].field->name);
+  }
+  printf(" %12s %10s %8s %12s %12s %10s %10s\n", "overcurrent", "energy", "writes", "latency avg", "latency max",
+         "peak 15m", "telegrams");
+
+  int failed = 0;
+  double simulated = 0;
+  for (uint32_t n = 0; n < runs; n++) {
+    const struct sim_scenario* s = &scenarios[n / sweep_combinations()];
+    const struct sim_result* r = &results[n];
+    int32_t values[SIM_MAX_SWEEPS];
+
+    sweep_values(n % sweep_combinations(), values);
+    printf("%-10s", s->name);
+    for (uint8_t i = 0; i < sweep_count; i++) {
+      printf(" %*d", (int)strlen(sweeps[i].field->name) > 6 ? (int)strlen(sweeps[i].field->name) : 6, values[i]);
+    }
+    printf(" %10.1f s %6.2f kWh %8u %9u ms %9u ms %7.2f kW %10u\n", r->overcurrent, r->energy, r->writes,
+           r->latency_count ? (uint32_t)(r->latency_sum / r->latency_count) : 0, r->latency_max, r->peak / 1000.0,
+           r->telegrams);
+    failed |= r->telegrams != r->expected;  // Every telegram with a valid CRC must be accepted
+    simulated += s->count;
+  }
+  printf("%u runs, %.1f h simulated in %.2f s on %ld workers, %.0fx real time\n", runs, simulated / 3600, elapsed,
+         jobs, simulated / elapsed);
+  return failed;
+}
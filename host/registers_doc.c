@@ -0,0 +1,312 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// The README register table and home-assistant/modbus.yaml from the register table in registers.h.
+//
+// Usage: registers_doc readme | inputs | yaml | check README.md modbus.yaml
+//   readme  print the README register table
+//   inputs  print the README input register table
+//   yaml    print home-assistant/modbus.yaml
+//   check   fail when either file differs from what would be printed
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "registers.h"
+
+#define DOC_SERVER_ADDRESS 10  // Default of MB_REG_CONFIG_ADDRESS
+#define DOC_COLUMNS        6
+
+struct doc_register {
+  uint16_t address;
+  const char* name;
+  const char* access;
+  const char* type;
+  const char* resolution;
+  const char* unit;
+  const char* default_;
+  const char* ha;
+  const char* description;
+};
+
+#define DOC_REGISTER(name, address, access, type, min_, max_, backing, resolution, unit, default_, ha, description) \
+  {(address), #name, #access, #type, resolution, unit, default_, ha, description},
+#define DOC_INPUT(name, address, type, resolution, unit, description) \
+  {(address), #name, "R", #type, resolution, unit, "", "", description},
+
+static const struct doc_register registers[] = {MB_REGISTERS(DOC_REGISTER)};
+static const struct doc_register charger_registers[] = {MB_CHARGER_REGISTERS(DOC_REGISTER, 0)};
+static const struct doc_register inputs[] = {MB_INPUT_REGISTERS(DOC_INPUT)};
+
+#define DOC_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+// Characters on screen, "µ" is two bytes
+static size_t display_width(const char* s) {
+  size_t width = 0;
+
+  for (; *s; s++) {
+    width += (*s & 0xC0) != 0x80;
+  }
+  return width;
+}
+
+// Fills the cells of a row, or of the header for row -1. Returns -1 after the last row.
+typedef int (*doc_cells_t)(char cells[DOC_COLUMNS][128], int row);
+
+static void table_row(FILE* out, char cells[DOC_COLUMNS][128], const size_t* width, int columns) {
+  for (int i = 0; i < columns; i++) {
+    fprintf(out, "| %s%*s ", cells[i], (int)(width[i] - display_width(cells[i])), "");
+  }
+  fprintf(out, "|\n");
+}
+
+static int readme_cells(char cells[DOC_COLUMNS][128], int row) {
+  int count = DOC_COUNT(registers) + DOC_COUNT(charger_registers);
+  const struct doc_register* reg;
+  int charger;
+
+  if (row < 0) {
+    const char* header[DOC_COLUMNS] = {"Register", "R/W", "Description", "Resolution", "Unit", "Default"};
+    for (int i = 0; i < DOC_COLUMNS; i++) {
+      strcpy(cells[i], header[i]);
+    }
+    return 0;
+  }
+  if (row == count) {  // The other chargers in one row
+    sprintf(cells[0], "%d", MB_REG_CHARGER(1, 0));
+    strcpy(cells[1], charger_registers[0].access);
+    sprintf(cells[2], "Second charger, same layout up to %d for the sixth",
+            charger_registers[DOC_COUNT(charger_registers) - 1].address +
+                (LB_MAX_CHARGERS - 1) * MB_REG_CHARGER_SIZE);
+    strcpy(cells[3], "");
+    strcpy(cells[4], "");
+    strcpy(cells[5], "2");
+    return 0;
+  }
+  if (row > count) {
+    return -1;
+  }
+
+  charger = row >= (int)DOC_COUNT(registers);
+  reg = charger ? &charger_registers[row - DOC_COUNT(registers)] : &registers[row];
+  sprintf(cells[0], "%d", reg->address);
+  strcpy(cells[1], reg->access);
+  sprintf(cells[2], "%s%s%s", charger ? "First charger " : "", reg->description,
+          strcmp(reg->type, "S16") ? "" : " (signed)");
+  strcpy(cells[3], reg->resolution);
+  strcpy(cells[4], reg->unit);
+  strcpy(cells[5], reg->default_);
+  return 0;
+}
+
+static int inputs_cells(char cells[DOC_COLUMNS][128], int row) {
+  const char* types[][2] = {{"U16", "uint16"}, {"U32", "uint32"}, {"S32", "int32"}};
+
+  if (row < 0) {
+    const char* header[] = {"Input register", "Type", "Description", "Resolution", "Unit"};
+    for (int i = 0; i < 5; i++) {
+      strcpy(cells[i], header[i]);
+    }
+    return 0;
+  }
+  if (row >= (int)DOC_COUNT(inputs)) {
+    return -1;
+  }
+
+  sprintf(cells[0], "%d", inputs[row].address);
+  for (size_t i = 0; i < DOC_COUNT(types); i++) {
+    if (!strcmp(inputs[row].type, types[i][0])) {
+      strcpy(cells[1], types[i][1]);
+    }
+  }
+  strcpy(cells[2], inputs[row].description);
+  strcpy(cells[3], inputs[row].resolution);
+  strcpy(cells[4], inputs[row].unit);
+  return 0;
+}
+
+static void table(FILE* out, doc_cells_t cells_of, int columns) {
+  char cells[DOC_COLUMNS][128];
+  size_t width[DOC_COLUMNS] = {0};
+
+  for (int row = -1; !cells_of(cells, row); row++) {
+    for (int i = 0; i < columns; i++) {
+      if (display_width(cells[i]) > width[i]) {
+        width[i] = display_width(cells[i]);
+      }
+    }
+  }
+
+  cells_of(cells, -1);
+  table_row(out, cells, width, columns);
+  for (int i = 0; i < columns; i++) {
+    fprintf(out, "|%.*s", (int)width[i] + 2, "----------------------------------------------------------------------");
+  }
+  fprintf(out, "|\n");
+  for (int row = 0; !cells_of(cells, row); row++) {
+    table_row(out, cells, width, columns);
+  }
+}
+
+static void readme(FILE* out) {
+  table(out, readme_cells, DOC_COLUMNS);
+}
+
+static void readme_inputs(FILE* out) {
+  table(out, inputs_cells, 5);
+}
+
+static const char* yaml_device_class(const char* unit) {
+  if (!strcmp(unit, "A")) {
+    return "current";
+  }
+  if (!strcmp(unit, "W") || !strcmp(unit, "kW")) {
+    return "power";
+  }
+  if (!strcmp(unit, "second") || !strcmp(unit, "ms")) {
+    return "duration";
+  }
+  if (!strcmp(unit, "V")) {
+    return "voltage";
+  }
+  if (!strcmp(unit, "kWh")) {
+    return "energy";
+  }
+  return NULL;
+}
+
+static void yaml_sensor(FILE* out, const struct doc_register* reg, int charger, int input) {
+  const char* device_class = yaml_device_class(reg->unit);
+  const char* decimals = strchr(reg->resolution, '.');
+  char name[64];
+  char* c;
+
+  if (!strchr(reg->access, 'R')) {
+    return;
+  }
+  if (*reg->ha) {
+    snprintf(name, sizeof(name), "%s", reg->ha);
+  } else if (charger) {
+    snprintf(name, sizeof(name), "charger_%d_%s", charger, reg->name + strlen("CHARGER_N_"));
+  } else {
+    snprintf(name, sizeof(name), "%s", reg->name);
+  }
+  for (c = name; *c; c++) {
+    *c = tolower(*c);
+  }
+
+  fprintf(out, "      - name: P1_LB_%s\n", name);
+  fprintf(out, "        unique_id: P1_LB_%s\n", name);
+  if (device_class) {
+    fprintf(out, "        device_class: %s\n", device_class);
+  }
+  if (!strcmp(reg->unit, "kWh")) {
+    fprintf(out, "        state_class: total_increasing\n");
+  }
+  if (*reg->unit) {
+    fprintf(out, "        unit_of_measurement: \"%s\"\n", strcmp(reg->unit, "second") ? reg->unit : "s");
+  }
+  fprintf(out, "        slave: %d\n", DOC_SERVER_ADDRESS);
+  fprintf(out, "        address: %d\n", reg->address);
+  if (input) {
+    fprintf(out, "        input_type: input\n");
+  }
+  fprintf(out, "        data_type: %sint%s\n", reg->type[0] == 'S' ? "" : "u", reg->type + 1);
+  if (*reg->resolution && strcmp(reg->resolution, "1")) {
+    fprintf(out, "        scale: %s\n", reg->resolution);
+    fprintf(out, "        precision: %d\n", decimals ? (int)strlen(decimals + 1) : 0);
+  }
+}
+
+static void yaml(FILE* out) {
+  fprintf(out,
+          "modbus:\n"
+          "  - name: p1_load_balancer\n"
+          "    type: serial\n"
+          "    baudrate: 9600\n"
+          "    bytesize: 8\n"
+          "    method: rtu\n"
+          "    parity: N\n"
+          "    port: /dev/ttyACM1\n"
+          "    stopbits: 1\n"
+          "    sensors:\n");
+  for (size_t i = 0; i < DOC_COUNT(registers); i++) {
+    yaml_sensor(out, &registers[i], 0, 0);
+  }
+  for (size_t i = 0; i < DOC_COUNT(charger_registers); i++) {
+    yaml_sensor(out, &charger_registers[i], 1, 0);
+  }
+  for (size_t i = 0; i < DOC_COUNT(inputs); i++) {
+    yaml_sensor(out, &inputs[i], 0, 1);
+  }
+}
+
+static char* read_file(const char* path) {
+  FILE* f = fopen(path, "rb");
+  char* data;
+  long size;
+
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  rewind(f);
+  data = calloc(size + 1, 1);
+  if (data && fread(data, 1, size, f) != (size_t)size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+// Compare what gen prints with the whole file, or with the part of it that starts with the table header marker
+static int check(const char* path, void (*gen)(FILE* out), const char* marker) {
+  char* expected;
+  char* actual = read_file(path);
+  char* start;
+  size_t size;
+  FILE* out;
+  int failed;
+
+  if (!actual) {
+    return 1;
+  }
+  out = open_memstream(&expected, &size);
+  gen(out);
+  fclose(out);
+
+  start = marker ? strstr(actual, marker) : actual;
+  failed = !start || (marker ? strncmp(start, expected, size) || start[size] == '|' : strcmp(start, expected));
+  if (failed) {
+    fprintf(stderr, "%s is out of date, regenerate it with registers_doc\n", path);
+  }
+  free(expected);
+  free(actual);
+  return failed;
+}
+
+int main(int argc, char** argv) {
+  if (argc == 2 && !strcmp(argv[1], "readme")) {
+    readme(stdout);
+    return 0;
+  }
+  if (argc == 2 && !strcmp(argv[1], "inputs")) {
+    readme_inputs(stdout);
+    return 0;
+  }
+  if (argc == 2 && !strcmp(argv[1], "yaml")) {
+    yaml(stdout);
+    return 0;
+  }
+  if (argc == 4 && !strcmp(argv[1], "check")) {
+    return check(argv[2], readme, "| Register ") | check(argv[2], readme_inputs, "| Input register ") |
+           check(argv[3], yaml, NULL);
+  }
+  fprintf(stderr, "Usage: %s readme | inputs | yaml | check README.md modbus.yaml\n", argv[0]);
+  return 1;
+}
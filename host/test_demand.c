@@ -0,0 +1,139 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Test of the power windows against averages computed from every second, with telegrams that come late or not at
+// all, and of the demand limit keeping the quarter-hour average of a charging vehicle under it.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "loadbalancer.h"
+
+#define TEST_SECONDS   (3 * 3600)
+#define DEMAND_LIMIT   8000   // W
+#define DEMAND_MARGIN  200    // W the quarter-hour average may go over, the vehicle follows late
+#define VEHICLE_LAG    2      // s
+
+static struct lb_config test_config = {
+    .charger_limit = 16000,
+    .number_of_phases = 3,
+    .alarm_limit = 24000,
+    .alarm_limit_wait_time = 1,
+    .alarm_limit_change_amount = 12500,
+    .upper_limit = 22000,
+    .upper_limit_wait_time = 5,
+    .upper_limit_change_amount = 1000,
+    .lower_limit = 19000,
+    .lower_limit_wait_time = 5,
+    .lower_limit_change_amount = 1000,
+    .fallback_limit = 0,
+    .fallback_limit_wait_time = 30,
+    .number_of_chargers = 1,
+    .charger_min_current = 6000,
+    .chargers = {{.phase_map = LB_PHASE_MAP_DEFAULT}},
+    .trigger = LB_TRIGGER_GRID_UPDATE,
+};
+
+static struct lb_context lb_ctx;
+static int16_t history[TEST_SECONDS][3];  // W held in every second
+static uint16_t limit;
+
+static void limit_charger(struct lb_context* ctx, uint8_t charger, uint16_t current) {
+  (void)ctx;
+  (void)charger;
+  limit = current;
+}
+
+static int test_windows(void) {
+  static const uint16_t seconds[] = {1, 60, LB_DEMAND_SECONDS};
+  int32_t power[3] = {0};
+  uint32_t t = 0;
+  uint32_t errors = 0;
+
+  lb_init(&lb_ctx, &test_config, limit_charger);
+  srand(1);
+
+  // The first telegram at 0 starts the windows, then mostly one every second and sometimes late or lost for a while
+  for (uint32_t gap = 0; t < TEST_SECONDS - 120; gap = rand() % 50 ? 1 : 1 + rand() % 120) {
+    for (uint32_t s = t; s < t + gap; s++) {
+      for (int phase = 0; phase < 3; phase++) {
+        history[s][phase] = power[phase];
+      }
+    }
+    t += gap;
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      power[phase] = rand() % 12001 - 2000;
+      lb_set_grid_power(&lb_ctx, phase, power[phase]);
+    }
+    lb_commit_grid_current(&lb_ctx, t * 1000);
+    if (t == 0) {
+      continue;
+    }
+
+    for (enum lb_window window = LB_WINDOW_1S; window <= LB_WINDOW_15MIN; window++) {
+      uint32_t n = seconds[window] < t ? seconds[window] : t;
+      int64_t total = 0;
+      for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+        int64_t sum = 0;
+        for (uint32_t s = t - n; s < t; s++) {
+          sum += history[s][phase];
+        }
+        total += sum;
+        errors += lb_get_average_power(&lb_ctx, window, phase) != (int32_t)(sum / n);
+      }
+      errors += lb_get_average_power(&lb_ctx, window, LB_PHASE_NONE) != (int32_t)(total / n);
+    }
+  }
+
+  printf("windows: %u s, errors %u\n", t, errors);
+  return errors != 0;
+}
+
+// A household of 3 kW with a 4 kW appliance for 10 minutes every hour
+static int test_limit(void) {
+  uint16_t pending[VEHICLE_LAG] = {0};
+  int64_t window[LB_DEMAND_SECONDS] = {0};
+  int64_t sum = 0;
+  int32_t peak = 0;
+  double energy = 0;
+
+  test_config.demand_limit = DEMAND_LIMIT;
+  lb_init(&lb_ctx, &test_config, limit_charger);
+  limit = 0;
+
+  for (uint32_t t = 1; t <= TEST_SECONDS; t++) {
+    int32_t draw = pending[t % VEHICLE_LAG];
+    int32_t total = 0;
+
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      int32_t household = t % 3600 < 600 ? 7000 / 3 : 1000;
+      int32_t power = household + draw * 230 / 1000;
+      total += power;
+      lb_set_grid_current(&lb_ctx, phase, power * 1000 / 230);
+      lb_set_grid_power(&lb_ctx, phase, power);
+    }
+    energy += draw * 3 * 230 / 3.6e9;
+
+    // The quarter-hour average as the meter would see it, whenever its quarter starts
+    sum += total - window[t % LB_DEMAND_SECONDS];
+    window[t % LB_DEMAND_SECONDS] = total;
+    if (t >= LB_DEMAND_SECONDS && sum / LB_DEMAND_SECONDS > peak) {
+      peak = sum / LB_DEMAND_SECONDS;
+    }
+
+    lb_commit_grid_current(&lb_ctx, t * 1000);
+    lb_task(&lb_ctx, t * 1000);
+    pending[t % VEHICLE_LAG] = limit;
+  }
+
+  printf("demand limit: %d W, peak %d W, charged %.2f kWh\n", DEMAND_LIMIT, peak, energy);
+  return peak > DEMAND_LIMIT + DEMAND_MARGIN || peak < DEMAND_LIMIT - DEMAND_MARGIN;
+}
+
+int main(void) {
+  int failed = 0;
+
+  failed |= test_windows();
+  failed |= test_limit();
+  return failed;
+}
@@ -0,0 +1,101 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Test of the DMA receive path with a simulated DMA channel writing the ring in ring mode.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dsmr.h"
+#include "esmr5.h"
+#include "ringbuf.h"
+
+#define TEST_BYTES 1000000UL
+
+struct dma_sim {
+  uint8_t* buf;
+  uint32_t mask;
+  uint32_t write_index;
+};
+
+static void dma_write(struct dma_sim* dma, uint8_t b) {
+  dma->buf[dma->write_index] = b;
+  dma->write_index = (dma->write_index + 1) & dma->mask;
+}
+
+// Random bursts less than a ring size between syncs, the consumer reads a random part of what is available. Every byte
+// must either arrive in order or be counted as overrun.
+static int test_stream(void) {
+  static uint8_t buf[64] __attribute__((aligned(64)));
+  struct dma_sim dma = {buf, sizeof(buf) - 1, 0};
+  struct ringbuf rb;
+  uint32_t sent = 0;
+  uint32_t received = 0;
+  uint32_t errors = 0;
+  uint32_t expected = 0;
+
+  ringbuf_init(&rb, buf, sizeof(buf));
+  srand(1);
+
+  while (sent < TEST_BYTES) {
+    uint32_t burst = rand() % sizeof(buf);
+    for (uint32_t i = 0; i < burst; i++) {
+      dma_write(&dma, (uint8_t)sent++);
+    }
+    ringbuf_dma_sync(&rb, dma.write_index);
+
+    if (rand() % 4 == 0) {
+      continue;  // Consumer busy
+    }
+    expected += ringbuf_overruns(&rb) - (expected - received);  // Skip the overwritten bytes
+    const uint8_t* data;
+    size_t len = ringbuf_read_span(&rb, &data);
+    len = len ? (size_t)(rand() % len) + 1 : 0;
+    for (size_t i = 0; i < len; i++) {
+      if (data[i] != (uint8_t)expected++) {
+        errors++;
+      }
+    }
+    received += len;
+    ringbuf_commit(&rb, len);
+  }
+  received += ringbuf_count(&rb);
+
+  printf("stream: sent %u, received %u, overruns %u, order errors %u\n", sent, received, ringbuf_overruns(&rb),
+         errors);
+  return errors || !ringbuf_overruns(&rb) || received + ringbuf_overruns(&rb) != sent;
+}
+
+static void dsmr_telegram(const struct dsmr_telegram* telegram) {
+  (void)telegram;
+}
+
+// The telegram arrives in bursts like the P1 port would deliver it while the task polls the DMA
+static int test_dsmr(void) {
+  struct dsmr_cb cb = {.telegram = dsmr_telegram};
+  struct ringbuf* rb;
+  struct dma_sim dma;
+  const size_t len = sizeof(ESMR5_TELEGRAM) - 1;
+
+  dsmr_init(&cb);
+  rb = dsmr_rx_ring();
+  dma = (struct dma_sim){rb->buf, rb->mask, 0};
+
+  for (int telegram = 0; telegram < 10; telegram++) {
+    for (size_t pos = 0; pos < len;) {
+      for (size_t chunk = 0; chunk < 100 && pos < len; chunk++) {
+        dma_write(&dma, ESMR5_TELEGRAM[pos++]);
+      }
+      ringbuf_dma_sync(rb, dma.write_index);
+      dsmr_task();
+    }
+  }
+
+  const struct dsmr_stats* stats = dsmr_get_stats();
+  printf("dsmr: telegrams %u, crc errors %u, overruns %u\n", stats->telegrams, stats->crc_errors, stats->overruns);
+  return stats->telegrams != 10 || stats->crc_errors || stats->overruns;
+}
+
+int main(void) {
+  return test_stream() || test_dsmr();
+}
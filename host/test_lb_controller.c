@@ -0,0 +1,220 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Comparison of the hysteresis and PI controller on one charger. The household switches appliances on and off and
+// ramps up a heat pump, the vehicle follows its limit two seconds late. The PI controller must not cause more
+// overcurrent than the hysteresis controller. Without charger feedback it must deliver more energy, with feedback the
+// hysteresis controller moves to the target in one step, so there it must come close. The hysteresis steps must keep
+// the timing of the one second checks they had: the wait time after entering a state, at least one, then a second more.
+// Without feedback the look ahead of the PI controller must follow the grid current. A start limit must wait for the
+// first measurement.
+
+#include <stdio.h>
+
+#include "loadbalancer.h"
+
+#define GRID_LIMIT    25000  // mA, the fuse
+#define SIM_SECONDS   (3 * 3600)
+#define VEHICLE_LAG   2      // s
+#define VEHICLE_MAX   16000  // mA
+#define RAMP_CURRENT  8000   // mA, a bit below what the start of the scenario allows
+
+static struct lb_config sim_config = {
+    .charger_limit = 16000,
+    .number_of_phases = 3,
+    .alarm_limit = 24000,
+    .alarm_limit_wait_time = 1,
+    .alarm_limit_change_amount = 12500,
+    .upper_limit = 22000,
+    .upper_limit_wait_time = 5,
+    .upper_limit_change_amount = 1000,
+    .lower_limit = 19000,
+    .lower_limit_wait_time = 5,
+    .lower_limit_change_amount = 1000,
+    .fallback_limit = 0,
+    .fallback_limit_wait_time = 30,
+    .number_of_chargers = 1,
+    .charger_min_current = 6000,
+    .chargers = {{.phase_map = LB_PHASE_MAP_DEFAULT}},
+    .trigger = LB_TRIGGER_GRID_UPDATE,
+    .pi_kp = 100,
+    .pi_ki = 200,
+    .pi_kd = 500,
+};
+
+struct result {
+  double energy;  // Ah per phase
+  uint32_t overcurrent;  // s a phase was over the fuse
+  uint32_t alarm;  // s a phase was over the alarm limit
+  uint32_t ramp;  // s until the vehicle first draws RAMP_CURRENT
+};
+
+static struct lb_context lb_ctx;
+static uint16_t limit;
+static uint32_t seed;
+
+static uint32_t sim_random(uint32_t range) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % range;
+}
+
+static void limit_charger(struct lb_context* ctx, uint8_t charger, uint16_t current) {
+  (void)ctx;
+  (void)charger;
+  limit = current;
+}
+
+// Household load of a phase at time t
+static int32_t base_load(enum lb_phase phase, uint32_t t) {
+  int32_t load = 1500 + phase * 500 + (int32_t)sim_random(301) - 150;
+
+  if (phase == LB_PHASE_1 && t % 1200 < 150) {
+    load += 9000;  // Kettle
+  }
+  if (phase == LB_PHASE_2 && t >= 3600 && t < 5400) {
+    load += 6000;  // Oven
+  }
+  if (t >= 5400 && t < 6000) {
+    load += (t - 5400) * 8000 / 600;  // Heat pump starting
+  } else if (t >= 6000 && t < 9000) {
+    load += 8000;
+  }
+  if (phase == LB_PHASE_3 && t % 900 >= 450 && t % 900 < 480) {
+    load += 12000;  // Dryer heater
+  }
+  return load;
+}
+
+static struct result run(enum lb_controller controller, bool feedback) {
+  struct result result = {0};
+  uint16_t pending[VEHICLE_LAG] = {0};
+  int32_t draw = 0;
+
+  seed = 2022;
+  limit = 0;
+  sim_config.controller = controller;
+  lb_init(&lb_ctx, &sim_config, limit_charger);
+
+  for (uint32_t t = 1; t <= SIM_SECONDS; t++) {
+    // The vehicle takes the limit written VEHICLE_LAG seconds ago
+    draw = pending[t % VEHICLE_LAG] < VEHICLE_MAX ? pending[t % VEHICLE_LAG] : VEHICLE_MAX;
+    result.energy += draw / 3600000.0;
+    if (result.ramp == 0 && draw >= RAMP_CURRENT) {
+      result.ramp = t;
+    }
+
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      int32_t grid = base_load(phase, t) + draw;
+      if (grid > GRID_LIMIT) {
+        result.overcurrent++;
+      }
+      if (grid > sim_config.alarm_limit) {
+        result.alarm++;
+      }
+      lb_set_grid_current(&lb_ctx, phase, grid);
+      if (feedback) {
+        lb_set_charger_current(&lb_ctx, 0, phase, draw);
+      }
+    }
+    lb_commit_grid_current(&lb_ctx, t * 1000);
+    lb_task(&lb_ctx, t * 1000);
+    pending[t % VEHICLE_LAG] = limit;
+  }
+  return result;
+}
+
+// Seconds of the first three hysteresis steps up, below the lower limit from the first check on
+static int run_wait(uint8_t wait_time, uint32_t first, uint32_t second, uint32_t third) {
+  struct lb_config config = sim_config;
+  uint32_t steps[3] = {0};
+  int count = 0;
+  uint32_t last;
+
+  config.controller = LB_CONTROLLER_HYSTERESIS;
+  config.trigger = LB_TRIGGER_TIMER;
+  config.lower_limit_wait_time = wait_time;
+  lb_init(&lb_ctx, &config, limit_charger);
+  for (uint32_t t = 1; t <= 30 && count < 3; t++) {
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      lb_set_grid_current(&lb_ctx, phase, 18000);
+    }
+    lb_commit_grid_current(&lb_ctx, t * 1001);
+    lb_task(&lb_ctx, t * 1001);
+    if (t > 1 && lb_get_limit(&lb_ctx) != last) {
+      steps[count++] = t - 1;
+    }
+    last = lb_get_limit(&lb_ctx);
+  }
+  printf("wait time %u s: steps after %u, %u and %u s\n", wait_time, steps[0], steps[1], steps[2]);
+  return steps[0] != first || steps[1] != second || steps[2] != third;
+}
+
+// Limit after the grid current jumps by 4 A, without feedback and with the charger at its limit for a while
+static uint32_t run_trend(uint16_t pi_kd) {
+  struct lb_config config = sim_config;
+
+  config.controller = LB_CONTROLLER_PI;
+  config.pi_kd = pi_kd;
+  lb_init(&lb_ctx, &config, limit_charger);
+  for (uint32_t t = 1; t <= 30; t++) {
+    int32_t grid = t < 30 ? 12000 : 16000;
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      lb_set_grid_current(&lb_ctx, phase, grid);
+    }
+    lb_commit_grid_current(&lb_ctx, t * 1000);
+    lb_task(&lb_ctx, t * 1000);
+  }
+  return lb_get_limit(&lb_ctx);
+}
+
+// Limits before and after the first measurement with a start limit of 12 A
+static int run_start_limit(int32_t grid, uint32_t expected) {
+  uint32_t before;
+
+  lb_init(&lb_ctx, &sim_config, limit_charger);
+  lb_set_start_limit(&lb_ctx, 12000);
+  for (uint32_t t = 1; t <= 3; t++) {
+    lb_task(&lb_ctx, t * 1001);
+  }
+  before = lb_get_limit(&lb_ctx);
+  for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+    lb_set_grid_current(&lb_ctx, phase, grid);
+  }
+  lb_commit_grid_current(&lb_ctx, 4000);
+  lb_task(&lb_ctx, 4000);
+  printf("start limit, grid %d mA: limit %u mA before and %u mA after the first measurement\n", grid, before,
+         lb_get_limit(&lb_ctx));
+  return before != 0 || lb_get_limit(&lb_ctx) != expected;
+}
+
+int main(void) {
+  int failed = 0;
+
+  failed |= run_wait(0, 1, 3, 5);
+  failed |= run_wait(1, 1, 3, 5);
+  failed |= run_wait(5, 5, 11, 17);
+
+  uint32_t with_trend = run_trend(sim_config.pi_kd);
+  uint32_t without_trend = run_trend(0);
+  printf("rising grid without feedback: limit %u mA, %u mA without look ahead\n", with_trend, without_trend);
+  failed |= with_trend >= without_trend;
+
+  failed |= run_start_limit(15000, 12000);
+  failed |= run_start_limit(23000, 0);
+
+  for (int feedback = 0; feedback < 2; feedback++) {
+    struct result hysteresis = run(LB_CONTROLLER_HYSTERESIS, feedback);
+    struct result pi = run(LB_CONTROLLER_PI, feedback);
+
+    printf("%s feedback:\n", feedback ? "with" : "without");
+    printf("  hysteresis: %6.2f Ah, overcurrent %4u s, over alarm %4u s, ramp %3u s\n", hysteresis.energy,
+           hysteresis.overcurrent, hysteresis.alarm, hysteresis.ramp);
+    printf("  PI        : %6.2f Ah, overcurrent %4u s, over alarm %4u s, ramp %3u s\n", pi.energy, pi.overcurrent,
+           pi.alarm, pi.ramp);
+    failed |= pi.overcurrent > hysteresis.overcurrent;
+    failed |= pi.energy < (feedback ? hysteresis.energy * 0.97 : hysteresis.energy);
+  }
+  return failed;
+}
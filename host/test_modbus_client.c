@@ -0,0 +1,273 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Test of the client request queue: coalescing, priorities, order and requests pushed out of the full queue. A fake
+// device answers every request, the tick is stepped by the test to check the round trip times, timeouts and retries.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "modbus_client.h"
+
+#define MAX_SENT 64
+
+static struct mb_client_context ctx;
+static uint32_t now_ms;
+static uint8_t sent[MAX_SENT][MB_MAX_RTU_FRAME_SIZE];
+static uint32_t sent_time[MAX_SENT];
+static size_t sent_count;
+static uint32_t status_count;
+static uint32_t status_time;
+static uint8_t status_address;
+static uint8_t status_function;
+static uint8_t status_error;
+static bool in_call;  // Inside an mb_client_* call that queues a request
+static uint32_t reentered;
+
+static uint32_t get_tick_ms(void) {
+  return now_ms;
+}
+
+static void tx(uint8_t* data, size_t len) {
+  if (sent_count < MAX_SENT) {
+    memcpy(sent[sent_count], data, len);
+    sent_time[sent_count] = now_ms;
+  }
+  sent_count++;
+}
+
+static void status(uint8_t address, uint8_t function, uint8_t error_code) {
+  if (in_call) {
+    reentered++;
+  }
+  if (error_code) {
+    status_count++;
+    status_time = now_ms;
+    status_address = address;
+    status_function = function;
+    status_error = error_code;
+  }
+}
+
+static void setup(void) {
+  struct mb_client_cb cb = {
+      .status = status,
+      .tx = tx,
+      .get_tick_ms = get_tick_ms,
+  };
+  mb_client_init(&ctx, &cb);
+  now_ms = 0;
+  sent_count = 0;
+  status_count = 0;
+  reentered = 0;
+}
+
+static uint16_t sent_word(size_t i, size_t offset) {
+  return sent[i][offset] << 8 | sent[i][offset + 1];
+}
+
+// Reads get zeros, writes their start and count or value back
+static void respond(void) {
+  const uint8_t* request = sent[sent_count - 1];
+  uint8_t response[MB_MAX_RTU_FRAME_SIZE];
+  size_t len;
+
+  if (request[1] == MB_READ_HOLDING_REGISTERS) {
+    uint16_t count = sent_word(sent_count - 1, 4);
+    response[0] = request[0];
+    response[1] = request[1];
+    response[2] = count * 2;
+    memset(&response[3], 0, count * 2);
+    len = 3 + count * 2;
+  } else {
+    memcpy(response, request, 6);
+    len = 6;
+  }
+  uint16_t crc = mb_calc_crc16(response, len);
+  response[len++] = crc >> 8;
+  response[len++] = crc & 0xFF;
+  for (size_t i = 0; i < len; i++) {
+    mb_client_rx(&ctx, response[i]);
+  }
+}
+
+// Runs the task until the queue is empty, answering every request
+static void serve(void) {
+  for (int i = 0; i < 200; i++) {
+    size_t count = sent_count;
+    now_ms++;
+    mb_client_task(&ctx);
+    if (sent_count > count) {
+      respond();
+    }
+  }
+}
+
+static void run(uint32_t ms) {
+  for (uint32_t i = 0; i < ms; i++) {
+    now_ms++;
+    mb_client_task(&ctx);
+  }
+}
+
+// One poll answered after rtt ms
+static void exchange(uint8_t address, uint32_t rtt) {
+  mb_client_read_holding_registers(&ctx, address, 0x4000, 2);
+  mb_client_task(&ctx);
+  now_ms += rtt;
+  respond();
+  mb_client_task(&ctx);
+}
+
+static struct mb_client_rtt* rtt_entry(uint8_t address) {
+  for (int i = 0; i < MB_CLIENT_RTT_SLOTS; i++) {
+    if (ctx.rtt[i].address == address) {
+      return &ctx.rtt[i];
+    }
+  }
+  return NULL;
+}
+
+static int check(const char* name, bool ok) {
+  printf("%-32s %s\n", name, ok ? "ok" : "FAILED");
+  return !ok;
+}
+
+int main(void) {
+  uint16_t limit[2] = {0, 16000};
+  uint8_t raw[8] = {0x03, MB_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x01};
+  uint16_t crc = mb_calc_crc16(raw, 6);
+  int res = 0;
+  bool ok;
+
+  raw[6] = crc >> 8;
+  raw[7] = crc & 0xFF;
+
+  // Only the newest request to an address, function and start is sent
+  setup();
+  mb_client_read_holding_registers(&ctx, 0x01, 0x4000, 2);
+  mb_client_read_holding_registers(&ctx, 0x01, 0x4000, 2);
+  mb_client_read_holding_registers(&ctx, 0x01, 0x4002, 2);
+  mb_client_read_holding_registers(&ctx, 0x02, 0x4000, 2);
+  mb_client_write_single_register(&ctx, 0x01, 0x4000, 5);
+  mb_client_write_single_register(&ctx, 0x01, 0x4000, 7);
+  ok = ctx.stats.queue_depth == 4 && ctx.stats.queue_coalesced == 2;
+  serve();
+  ok = ok && sent_count == 4 && sent[0][1] == MB_WRITE_SINGLE_REGISTER && sent_word(0, 4) == 7;
+  res |= check("coalesce", ok);
+
+  // Writes go before pass-through requests and those before polls, whenever they were queued
+  setup();
+  mb_client_read_holding_registers(&ctx, 0x01, 0x4000, 2);
+  mb_client_send_raw(&ctx, raw, sizeof(raw));
+  mb_client_write_multiple_registers(&ctx, 0x01, 0x4100, limit, 2);
+  serve();
+  ok = sent_count == 3 && sent[0][1] == MB_WRITE_MULTIPLE_REGISTERS && sent[1][0] == 0x03 &&
+       sent[2][1] == MB_READ_HOLDING_REGISTERS;
+  res |= check("control before raw before poll", ok);
+
+  // Within a priority the oldest request goes first
+  setup();
+  for (int i = 0; i < 4; i++) {
+    mb_client_read_holding_registers(&ctx, 0x01, 0x4000 + 2 * i, 2);
+    mb_client_write_single_register(&ctx, 0x01, 0x4100 + i, i);
+  }
+  serve();
+  ok = sent_count == 8;
+  for (size_t i = 0; ok && i < 4; i++) {
+    ok = sent[i][1] == MB_WRITE_SINGLE_REGISTER && sent_word(i, 2) == 0x4100 + i &&
+         sent[4 + i][1] == MB_READ_HOLDING_REGISTERS && sent_word(4 + i, 2) == 0x4000 + 2 * i;
+  }
+  res |= check("first in first out", ok);
+
+  // A write pushes out the newest poll from the full queue, its owner hears about it from the task
+  setup();
+  for (int i = 0; i < MB_CLIENT_QUEUE_SIZE; i++) {
+    mb_client_read_holding_registers(&ctx, 0x01, 0x4000 + 2 * i, 2);
+  }
+  in_call = true;
+  ok = mb_client_write_multiple_registers(&ctx, 0x01, 0x4100, limit, 2) == 0;
+  in_call = false;
+  ok = ok && ctx.stats.queue_dropped == 1 && status_count == 0;
+  mb_client_task(&ctx);
+  ok = ok && status_count == 1 && status_address == 0x01 && status_function == MB_READ_HOLDING_REGISTERS &&
+       status_error == MB_ERROR_DROPPED;
+  respond();
+  serve();
+  ok = ok && sent_count == MB_CLIENT_QUEUE_SIZE && sent_word(sent_count - 1, 2) == 0x4000 + 2 * 14;
+  res |= check("dropped request", ok && reentered == 0);
+
+  // Nothing is pushed out for a request with the same priority, it is refused
+  setup();
+  for (int i = 0; i < MB_CLIENT_QUEUE_SIZE; i++) {
+    mb_client_write_single_register(&ctx, 0x01, 0x4100 + i, i);
+  }
+  ok = mb_client_write_single_register(&ctx, 0x01, 0x4200, 1) != 0 && ctx.stats.queue_dropped == 1;
+  mb_client_task(&ctx);
+  res |= check("full queue", ok && status_count == 0);
+
+  // The first sample sets srtt and rttvar to rtt and rtt / 2, later ones move them by 1/8 and 1/4 of the error
+  setup();
+  exchange(0x01, 40);
+  ok = rtt_entry(0x01) && rtt_entry(0x01)->srtt == 40 * 8 && rtt_entry(0x01)->rttvar == 20 * 4 &&
+       mb_client_get_timeout(&ctx, 0x01) == 40 + 80;
+  exchange(0x01, 40);
+  ok = ok && rtt_entry(0x01)->srtt == 40 * 8 && rtt_entry(0x01)->rttvar == 60 &&
+       mb_client_get_timeout(&ctx, 0x01) == 100;
+  exchange(0x01, 80);
+  ok = ok && rtt_entry(0x01)->srtt == 45 * 8 && rtt_entry(0x01)->rttvar == 85 &&
+       mb_client_get_timeout(&ctx, 0x01) == 130;
+  res |= check("round trip time", ok && status_count == 0);
+
+  // The timeout stays within MB_CLIENT_MIN_TIMEOUT and MB_CLIENT_REQUEST_TIMEOUT
+  setup();
+  exchange(0x01, 1);
+  exchange(0x02, 900);
+  ok = mb_client_get_timeout(&ctx, 0x01) == MB_CLIENT_MIN_TIMEOUT &&
+       mb_client_get_timeout(&ctx, 0x02) == MB_CLIENT_REQUEST_TIMEOUT &&
+       mb_client_get_timeout(&ctx, 0x03) == MB_CLIENT_REQUEST_TIMEOUT;
+  res |= check("timeout clamp", ok);
+
+  // A request sent at tick 0 to an address that never responded times out once, without retries
+  setup();
+  mb_client_read_holding_registers(&ctx, 0x01, 0x4000, 2);
+  mb_client_task(&ctx);
+  run(MB_CLIENT_REQUEST_TIMEOUT + 10);
+  ok = sent_count == 1 && status_count == 1 && status_error == MB_ERROR_TIMEOUT &&
+       status_time == MB_CLIENT_REQUEST_TIMEOUT + 1;
+  res |= check("timeout at tick 0", ok);
+
+  // Every retry doubles the timeout and the backoff before it, after the last one the owner hears of the timeout
+  setup();
+  exchange(0x01, 1);
+  now_ms = 1000;
+  sent_count = 0;
+  mb_client_read_holding_registers(&ctx, 0x01, 0x4000, 2);
+  mb_client_task(&ctx);
+  run(1000);
+  ok = sent_count == 1 + MB_CLIENT_RETRIES && sent_time[0] == 1000 && sent_time[1] == 1000 + 51 + 20 &&
+       sent_time[2] == 1071 + 101 + 40 && status_count == 1 && status_time == 1212 + 201 && ctx.stats.retries == 2;
+  res |= check("retry backoff", ok);
+
+  // A response to a request that was sent again does not tell which attempt it answers (Karn)
+  setup();
+  exchange(0x01, 1);
+  mb_client_read_holding_registers(&ctx, 0x01, 0x4000, 2);
+  mb_client_task(&ctx);
+  run(51 + 20 + 30);
+  respond();
+  mb_client_task(&ctx);
+  ok = sent_count == 3 && status_count == 0 && ctx.current_request == NULL && rtt_entry(0x01)->srtt == 1 * 8;
+  res |= check("no sample from a retry", ok);
+
+  // Pass-through requests are left to their sender to retry
+  setup();
+  exchange(0x03, 1);
+  mb_client_send_raw(&ctx, raw, sizeof(raw));
+  mb_client_task(&ctx);
+  run(1000);
+  ok = sent_count == 2 && status_count == 1 && status_address == 0x03 && status_error == MB_ERROR_TIMEOUT;
+  res |= check("no retry of a raw request", ok && ctx.stats.retries == 0);
+
+  return res;
+}
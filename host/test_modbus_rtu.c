@@ -0,0 +1,175 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Test of the RTU silent interval detection of the client with timestamped byte streams.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "modbus_client.h"
+
+#define BAUDRATE 9600
+#define CHAR_US  1146  // 11 bit characters at 9600 baud
+
+struct line_byte {
+  uint32_t us;
+  uint8_t b;
+};
+
+static struct mb_client_context ctx;
+static struct line_byte line[64];
+static size_t line_len;
+static size_t line_pos;
+static uint32_t now_us;
+static uint32_t delivered_us;
+static uint32_t errors;
+
+static uint32_t get_tick_us(void) {
+  return now_us;
+}
+
+static uint32_t get_tick_ms(void) {
+  return now_us / 1000;
+}
+
+static void tx(uint8_t* data, size_t len) {
+  (void)data;
+  (void)len;
+}
+
+static void read_holding_registers(uint8_t address, uint16_t start, uint16_t count, uint16_t* data) {
+  if (address == 1 && start == 0x4000 && count == 2 && data[0] == 1 && data[1] == 2) {
+    delivered_us = now_us;
+  }
+}
+
+static void status(uint8_t address, uint8_t function, uint8_t error_code) {
+  (void)address;
+  (void)function;
+  if (error_code) {
+    errors++;
+  }
+}
+
+static void setup(bool timed) {
+  struct mb_client_cb cb = {
+      .read_holding_registers = read_holding_registers,
+      .read_input_registers = read_holding_registers,
+      .status = status,
+      .tx = tx,
+      .get_tick_ms = get_tick_ms,
+      .get_tick_us = get_tick_us,
+  };
+  mb_client_init(&ctx, &cb);
+  if (timed) {
+    mb_client_set_baudrate(&ctx, BAUDRATE);
+  }
+  line_len = 0;
+  line_pos = 0;
+  now_us = 0;
+  delivered_us = 0;
+  errors = 0;
+}
+
+static void line_add(uint32_t us, const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    line[line_len++] = (struct line_byte){us + i * CHAR_US, data[i]};
+  }
+}
+
+static void line_add_response(uint32_t us, size_t gap_after, uint32_t gap_us) {
+  uint8_t response[] = {0x01, MB_READ_HOLDING_REGISTERS, 0x04, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00};
+  uint16_t crc = mb_calc_crc16(response, sizeof(response) - 2);
+
+  response[sizeof(response) - 2] = crc >> 8;
+  response[sizeof(response) - 1] = crc & 0xFF;
+  line_add(us, response, gap_after);
+  line_add(us + gap_after * CHAR_US + gap_us, &response[gap_after], sizeof(response) - gap_after);
+}
+
+// The task polls every poll_us, every byte is in the ring once its last bit arrived
+static void run(uint32_t end_us, uint32_t poll_us) {
+  mb_client_read_holding_registers(&ctx, 0x01, 0x4000, 2);
+  for (; now_us < end_us; now_us += poll_us) {
+    while (line_pos < line_len && line[line_pos].us + CHAR_US <= now_us) {
+      mb_client_rx(&ctx, line[line_pos++].b);
+    }
+    mb_client_task(&ctx);
+  }
+}
+
+static int check(const char* name, bool delivered) {
+  bool ok = delivered == (delivered_us != 0);
+  printf("%-32s %s (delivered at %u us, errors %u)\n", name, ok ? "ok" : "FAILED", delivered_us, errors);
+  return !ok;
+}
+
+int main(void) {
+  const uint8_t stray = 0x55;
+  int res = 0;
+
+  setup(true);
+  if (ctx.rx.t35_us < 3 * CHAR_US || ctx.rx.t35_us > 4 * CHAR_US) {
+    printf("t3.5 of %u us at %u baud\n", ctx.rx.t35_us, BAUDRATE);
+    return 1;
+  }
+  mb_rtu_rx_set_baudrate(&ctx.rx, 115200);
+  if (ctx.rx.t15_us != 750 || ctx.rx.t35_us != 1750) {
+    printf("Silent intervals not fixed above 19200 baud\n");
+    return 1;
+  }
+
+  setup(true);
+  line_add_response(10000, 0, 0);
+  run(50000, 100);
+  res |= check("response", true);
+
+  // Without the silent intervals the stray byte spoils the response and only the request timeout recovers
+  setup(false);
+  line_add(2000, &stray, 1);
+  line_add_response(20000, 0, 0);
+  run(50000, 100);
+  res |= check("stray byte without t3.5", false);
+
+  setup(true);
+  line_add(2000, &stray, 1);
+  line_add_response(20000, 0, 0);
+  run(50000, 100);
+  res |= check("stray byte", true);
+
+  // A stray byte glued to the response corrupts it, the rest of the frame is discarded and the request retried
+  setup(true);
+  line_add(20000 - CHAR_US, &stray, 1);
+  line_add_response(20000, 0, 0);
+  run(50000, 100);
+  res |= check("stray byte within frame", false) || ctx.stats.retries != 1;
+
+  setup(true);
+  line_add_response(10000, 3, 2 * CHAR_US);
+  run(50000, 100);
+  res |= check("t1.5 gap within frame", false);
+
+  setup(true);
+  line_add_response(10000, 3, CHAR_US);
+  run(50000, 100);
+  res |= check("short gap within frame", true);
+
+  // A task that runs less often than t1.5 can't see the gaps, but must not split a frame either
+  setup(true);
+  line_add_response(10000, 0, 0);
+  run(50000, 5000);
+  res |= check("response, 5 ms task", true);
+
+  setup(true);
+  line_add_response(10000, 0, 0);
+  run(50000, 2000);
+  res |= check("response, 2 ms task", true);
+
+  setup(true);
+  line_add(2000, &stray, 1);
+  line_add_response(20000, 0, 0);
+  run(50000, 1000);
+  res |= check("stray byte, 1 ms task", true);
+
+  return res;
+}
@@ -0,0 +1,201 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Simulation of several chargers behind one grid connection. The household load wanders and switches appliances, the
+// vehicles follow their limit a second late. With all chargers active the grid current must stay below the fuse for
+// every policy and trigger.
+
+#include <stdio.h>
+
+#include "loadbalancer.h"
+
+#define GRID_LIMIT    25000  // mA, the fuse
+#define SIM_SECONDS   (4 * 3600)
+#define CHARGERS      4
+#define BASE_MIN      500
+#define BASE_MAX      8000
+#define BASE_DRIFT    300   // mA per second at most
+#define APPLIANCE     2000  // mA switched at once
+#define APPLIANCE_GAP 60    // s between switching appliances at least
+
+static struct lb_config sim_config = {
+    .charger_limit = 16000,
+    .number_of_phases = 3,
+    .alarm_limit = 24000,
+    .alarm_limit_wait_time = 1,
+    .alarm_limit_change_amount = 12500,
+    .upper_limit = 22000,
+    .upper_limit_wait_time = 5,
+    .upper_limit_change_amount = 1000,
+    .lower_limit = 19000,
+    .lower_limit_wait_time = 5,
+    .lower_limit_change_amount = 1000,
+    .fallback_limit = 0,
+    .fallback_limit_wait_time = 30,
+    .number_of_chargers = CHARGERS,
+    .charger_min_current = 6000,
+    .chargers =
+        {
+            {.phase_map = LB_PHASE_MAP_DEFAULT, .priority = 1},
+            {.phase_map = LB_PHASE_MAP(LB_PHASE_2, LB_PHASE_3, LB_PHASE_1), .priority = 0},
+            {.phase_map = LB_PHASE_MAP(LB_PHASE_2, LB_PHASE_NONE, LB_PHASE_NONE), .priority = 2},
+            {.phase_map = LB_PHASE_MAP_DEFAULT, .priority = 3},
+        },
+};
+
+static const int32_t vehicle_max[CHARGERS] = {16000, 16000, 10000, 13000};  // What the vehicles take at most
+
+static struct lb_context lb_ctx;
+static uint16_t limit[CHARGERS];  // As written to the chargers
+static uint32_t limit_errors;
+static uint32_t seed = 2022;
+
+static uint32_t sim_random(uint32_t range) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % range;
+}
+
+static void limit_charger(struct lb_context* ctx, uint8_t charger, uint16_t current) {
+  (void)ctx;
+  if (charger >= CHARGERS || current > sim_config.charger_limit ||
+      (current && current < sim_config.charger_min_current)) {
+    limit_errors++;
+    return;
+  }
+  limit[charger] = current;
+}
+
+static int run(enum lb_policy policy, enum lb_trigger trigger) {
+  static const char* const names[] = {"equal", "priority", "first come"};
+  static const char* const triggers[] = {"timer", "grid"};
+  int32_t base[3] = {4000, 3000, 2000};
+  int32_t draw[CHARGERS] = {0};
+  int32_t grid_max = 0;
+  uint64_t charged[CHARGERS] = {0};  // mAs
+  uint32_t over_limit = 0, overbooked = 0;
+  uint32_t appliance_time = 0;
+
+  sim_config.policy = policy;
+  sim_config.trigger = trigger;
+  lb_init(&lb_ctx, &sim_config, limit_charger);
+  limit_errors = 0;
+  for (int i = 0; i < CHARGERS; i++) {
+    limit[i] = 0;
+  }
+
+  for (uint32_t t = 1; t <= SIM_SECONDS; t++) {
+    int32_t grid[3];
+
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      base[phase] += (int32_t)sim_random(2 * BASE_DRIFT + 1) - BASE_DRIFT;
+      if (t - appliance_time >= APPLIANCE_GAP && sim_random(20) == 0) {
+        appliance_time = t;
+        base[phase] += sim_random(2) ? APPLIANCE : -APPLIANCE;
+      }
+      base[phase] = base[phase] < BASE_MIN ? BASE_MIN : base[phase] > BASE_MAX ? BASE_MAX : base[phase];
+      grid[phase] = base[phase];
+    }
+
+    // The vehicles follow the limit of the previous second
+    for (int i = 0; i < CHARGERS; i++) {
+      draw[i] = limit[i] < vehicle_max[i] ? limit[i] : vehicle_max[i];
+      charged[i] += draw[i];
+      for (int c = 0; c < 3; c++) {
+        enum lb_phase phase = LB_PHASE_MAP_GET(sim_config.chargers[i].phase_map, c);
+        if (phase != LB_PHASE_NONE) {
+          grid[phase] += draw[i];
+        }
+      }
+    }
+
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      if (grid[phase] > GRID_LIMIT) {
+        over_limit++;
+      }
+      if (grid[phase] > grid_max) {
+        grid_max = grid[phase];
+      }
+      lb_set_grid_current(&lb_ctx, phase, grid[phase]);
+    }
+    for (int i = 0; i < CHARGERS; i++) {
+      for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+        bool connected = LB_PHASE_MAP_GET(sim_config.chargers[i].phase_map, phase) != LB_PHASE_NONE;
+        lb_set_charger_current(&lb_ctx, i, phase, connected ? draw[i] : 0);
+      }
+    }
+
+    lb_commit_grid_current(&lb_ctx, t * 1001);
+    lb_task(&lb_ctx, t * 1001);  // Just over the check interval
+
+    // The limits on a phase may never add up to more than what the load balancer made available
+    int32_t booked[3] = {0};
+    for (int i = 0; i < CHARGERS; i++) {
+      for (int c = 0; c < 3; c++) {
+        enum lb_phase phase = LB_PHASE_MAP_GET(sim_config.chargers[i].phase_map, c);
+        if (phase != LB_PHASE_NONE) {
+          booked[phase] += lb_get_charger_limit(&lb_ctx, i);
+        }
+      }
+    }
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      if (booked[phase] > (int32_t)lb_get_limit(&lb_ctx)) {
+        overbooked++;
+      }
+    }
+  }
+
+  printf("%-10s %-5s: grid max %5d mA, over limit %u s, overbooked %u, limit errors %u, charged", names[policy],
+         triggers[trigger], grid_max, over_limit, overbooked, limit_errors);
+  for (int i = 0; i < CHARGERS; i++) {
+    printf(" %5.2f", charged[i] / 3600000.0);
+  }
+  printf(" Ah\n");
+  return over_limit || overbooked || limit_errors;
+}
+
+// Without load the limit of six chargers rises past what fits in 16 bits
+static int run_idle(void) {
+  struct lb_config config = sim_config;
+  uint32_t total = LB_MAX_CHARGERS * config.charger_limit;
+
+  config.number_of_chargers = LB_MAX_CHARGERS;
+  for (int i = 0; i < LB_MAX_CHARGERS; i++) {
+    config.chargers[i].phase_map = LB_PHASE_MAP_DEFAULT;
+  }
+  lb_init(&lb_ctx, &config, NULL);
+  for (uint32_t t = 1; t < 600; t++) {
+    for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+      lb_set_grid_current(&lb_ctx, phase, 0);
+    }
+    lb_commit_grid_current(&lb_ctx, t * 1001);
+    lb_task(&lb_ctx, t * 1001);
+  }
+
+  printf("idle, %d chargers: limit %u mA of %u mA\n", LB_MAX_CHARGERS, lb_get_limit(&lb_ctx), total);
+  if (lb_get_limit(&lb_ctx) != total) {
+    return 1;
+  }
+
+  // The override holds all chargers together
+  lb_set_charger_limit_override(&lb_ctx, 20000);
+  for (uint32_t t = 600; t < 620; t++) {
+    lb_commit_grid_current(&lb_ctx, t * 1001);
+    lb_task(&lb_ctx, t * 1001);
+  }
+  printf("idle, %d chargers: limit %u mA with a 20000 mA override\n", LB_MAX_CHARGERS, lb_get_limit(&lb_ctx));
+  return lb_get_limit(&lb_ctx) != 20000;
+}
+
+int main(void) {
+  int failed = 0;
+
+  for (enum lb_policy policy = LB_POLICY_EQUAL; policy < LB_POLICY_LAST; policy++) {
+    for (enum lb_trigger trigger = LB_TRIGGER_TIMER; trigger < LB_TRIGGER_LAST; trigger++) {
+      failed |= run(policy, trigger);
+    }
+  }
+  failed |= run_idle();
+  return failed;
+}
@@ -0,0 +1,72 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+// Stress test of the SPSC ring with a producer and a consumer thread.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include "ringbuf.h"
+
+#define TEST_BYTES 2000000UL
+
+static uint8_t buf[64];
+static struct ringbuf rb;
+static bool blocking;
+
+static void* producer(void* arg) {
+  (void)arg;
+  for (uint32_t i = 0; i < TEST_BYTES; i++) {
+    while (!ringbuf_put(&rb, (uint8_t)i) && blocking) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+// When the producer retries every byte must arrive in order, when it drops every byte must either arrive or be counted
+// as overrun.
+static int run(bool blocking_) {
+  pthread_t thread;
+  uint32_t received = 0;
+  uint32_t errors = 0;
+  uint8_t expected = 0;
+
+  blocking = blocking_;
+  ringbuf_init(&rb, buf, sizeof(buf));
+  pthread_create(&thread, NULL, producer, NULL);
+
+  for (;;) {
+    const uint8_t* data;
+    size_t len = ringbuf_read_span(&rb, &data);
+    if (len == 0) {
+      if (received + (blocking ? 0 : ringbuf_overruns(&rb)) == TEST_BYTES) {
+        break;
+      }
+      sched_yield();
+      continue;
+    }
+    for (size_t i = 0; i < len; i++) {
+      if (blocking && data[i] != expected) {
+        errors++;
+      }
+      expected = data[i] + 1;
+    }
+    received += len;
+    ringbuf_commit(&rb, len);
+  }
+
+  pthread_join(thread, NULL);
+  printf("%s: received %u, overruns %u, order errors %u\n", blocking ? "retrying" : "dropping", received,
+         ringbuf_overruns(&rb), errors);
+  return errors || received + (blocking ? 0 : ringbuf_overruns(&rb)) != TEST_BYTES;
+}
+
+int main(void) {
+  if (ringbuf_init(&rb, buf, 48) == 0) {
+    printf("Size not a power of two accepted\n");
+    return 1;
+  }
+  return run(true) || run(false);
+}
@@ -0,0 +1,64 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "modbus_client.h"
+
+// Support for ABB Terra AC charger
+
+#define ABB_TAC_ADDRESS       1
+#define ABB_TAC_POLL_INTERVAL 1000  // ms
+
+enum abb_tac_state {
+  ABB_TAC_STATE_IDLE = 0,        // A: no vehicle
+  ABB_TAC_STATE_PENDING,         // B1: vehicle plugged in, pending authorization
+  ABB_TAC_STATE_CONNECTED,       // B2: vehicle plugged in, charger ready
+  ABB_TAC_STATE_READY,           // C1: vehicle ready
+  ABB_TAC_STATE_CHARGING,        // C2: charging
+  ABB_TAC_STATE_OTHER,
+  ABB_TAC_STATE_UNKNOWN = 0xFF,  // Not polled yet or not responding
+};
+
+struct abb_tac_stats {
+  uint32_t writes_sent;
+  uint32_t writes_skipped;   // The charger already has the limit
+  uint32_t readback_errors;  // The limit read back differed from the one written
+};
+
+struct abb_tac;
+typedef void (*abb_tac_update_cb_t)(const struct abb_tac* tac);
+
+struct abb_tac {
+  struct mb_client_context* mb;
+  uint8_t address;
+  abb_tac_update_cb_t update;  // Called with every new status poll
+  uint32_t poll_time;
+  // Polled status
+  enum abb_tac_state state;
+  int32_t current[3];  // mA per phase
+  uint32_t keepalive;  // ms, write an unchanged limit again after this time, 0 to never
+  // Shadow of the charging current limit register, valid while the charger is assumed to have it
+  uint16_t limit;
+  bool limit_valid;
+  uint32_t limit_time;
+  uint16_t pending;  // Written, but not acknowledged yet
+  bool write_pending;
+  uint32_t write_time;
+  bool mismatch;  // The last read back differed, the same limit is written again after a hold off
+  uint16_t cap;  // mA the charger lowers the limit to, learned from the read back
+  struct abb_tac_stats stats;
+};
+
+void abb_tac_init(struct abb_tac* tac, struct mb_client_context* mb, uint8_t address, uint32_t keepalive,
+                  abb_tac_update_cb_t update);
+void abb_tac_set_limit(struct abb_tac* tac, uint16_t current, uint32_t now);  // mA
+void abb_tac_task(struct abb_tac* tac, uint32_t now);
+
+// To be called from the modbus client callbacks
+void abb_tac_read_holding_registers(struct abb_tac* tac, uint8_t address, uint16_t start, uint16_t count,
+                                    uint16_t* data);
+void abb_tac_status(struct abb_tac* tac, uint8_t address, uint8_t function, uint8_t error_code);
@@ -7,14 +7,23 @@
 #include <hardware/sync.h>
 #include <stdint.h>
 
+#include "dsmr.h"
 #include "loadbalancer.h"
 
 #define FLASH_ROM_OFFSET    0x10000000
 #define FLASH_CONFIG_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_PAGE_SIZE)
 
+// Increase when the layout of struct config changes, config_load() migrates the older ones it knows
+#define CONFIG_VERSION 1
+
 struct config {
   uint8_t address;
+  uint8_t version;  // CONFIG_VERSION, padding before version 1
   struct lb_config lb_config;
+  uint8_t current_source;  // enum dsmr_current_source
+  uint8_t charger_keepalive;  // s, 0 to only write the charger limit when it changes
+  uint8_t charger_address[LB_MAX_CHARGERS];  // Modbus address of each charger
+  uint8_t restore_limit;  // Start from the limit from before a reset
   uint16_t _crc;
 };
 _Static_assert(sizeof(struct config) <= FLASH_PAGE_SIZE, "config struct too big");
@@ -1,23 +1,231 @@
 //  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
 //  SPDX-License-Identifier: MIT
 
-#define MB_REG_CHARGER_LIMIT_OVERRIDE           1000  // RW
-#define MB_REG_CURRENT_LIMIT                    1001  // R
-#define MB_REG_ERROR                            1002  // R
-#define MB_REG_LB_STATE                         1003  // R
-#define MB_REG_CONFIG_CHARGER_LIMIT             1010  // RW
-#define MB_REG_CONFIG_NUMBER_OF_PHASES          1011  // RW
-#define MB_REG_CONFIG_ALARM_LIMIT               1012  // RW
-#define MB_REG_CONFIG_ALARM_LIMIT_WAIT_TIME     1013  // RW
-#define MB_REG_CONFIG_ALARM_LIMIT_CHANGE_AMOUNT 1014  // RW
-#define MB_REG_CONFIG_UPPER_LIMIT               1015  // RW
-#define MB_REG_CONFIG_UPPER_LIMIT_WAIT_TIME     1016  // RW
-#define MB_REG_CONFIG_UPPER_LIMIT_CHANGE_AMOUNT 1017  // RW
-#define MB_REG_CONFIG_LOWER_LIMIT               1018  // RW
-#define MB_REG_CONFIG_LOWER_LIMIT_WAIT_TIME     1019  // RW
-#define MB_REG_CONFIG_LOWER_LIMIT_CHANGE_AMOUNT 1020  // RW
-#define MB_REG_CONFIG_FALLBACK_LIMIT            1021  // RW
-#define MB_REG_CONFIG_FALLBACK_LIMIT_WAIT_TIME  1022  // RW
-#define MB_REG_CONFIG_ADDRESS                   1090  // W
-#define MB_REG_CONFIG_APPLY                     1091  // W
-#define MB_REG_CONFIG_FACTORY_RESET             1092  // W
+#pragma once
+
+#include <stdint.h>
+
+#include "dsmr.h"
+#include "loadbalancer.h"
+#include "modbus_common.h"
+
+// The holding registers by address:
+//   X(name, address, access, type, min, max, backing, resolution, unit, default, ha, description)
+// A U32 register also takes the next address, the high word first. A write outside min - max is refused. The backing is
+// MB_FIELD() for a variable that is read and written as is, or MB_FN() with a getter, setter and index. ha is the Home
+// Assistant name and unique_id without the P1_LB_ prefix of the registers that had a sensor before this table, so their
+// entities keep their ids, "" for the lowercase name.
+// src/main.c builds the lookup table from this and host/registers_doc.c the README table and
+// home-assistant/modbus.yaml, which do not expand the backing.
+#define MB_REGISTERS(X)                                                                                                \
+  X(CHARGER_LIMIT_OVERRIDE, 1000, RW, U16, 0, 0xFFFF, MB_FN(get_limit_override, set_limit_override, 0), "0.001", "A",  \
+    "", "current_override", "Override the total limit of all chargers (applied directly)")                             \
+  X(CURRENT_LIMIT, 1001, R, U16, 0, 0, MB_FN(get_current_limit, NULL, 0), "0.001", "A", "", "current",                 \
+    "Current the load balancer allows all chargers on a phase")                                                        \
+  X(ERROR, 1002, R, U16, 0, 0, MB_FIELD(system_error), "", "", "", "", "Modbus client errors")                         \
+  X(LB_STATE, 1003, R, U16, 0, 0, MB_FN(get_lb_state, NULL, 0), "", "", "", "state",                                   \
+    "The current load balancer state")                                                                                 \
+  X(CHARGER_STATE, 1004, R, U16, 0, 0, MB_FN(get_charger_state, NULL, 0), "", "", "", "",                              \
+    "First charger state (see below)")                                                                                 \
+  X(CHARGER_CURRENT_L1, 1005, R, U16, 0, 0, MB_FN(get_charger_current, NULL, MB_INDEX(0, 0)), "0.001", "A", "", "",    \
+    "First charger current L1")                                                                                        \
+  X(CHARGER_CURRENT_L2, 1006, R, U16, 0, 0, MB_FN(get_charger_current, NULL, MB_INDEX(0, 1)), "0.001", "A", "", "",    \
+    "First charger current L2")                                                                                        \
+  X(CHARGER_CURRENT_L3, 1007, R, U16, 0, 0, MB_FN(get_charger_current, NULL, MB_INDEX(0, 2)), "0.001", "A", "", "",    \
+    "First charger current L3")                                                                                        \
+  X(CURRENT_LIMIT_TOTAL, 1008, R, U32, 0, 0, MB_FIELD(lb_ctx.charger_max_current), "0.001", "A", "", "",               \
+    "Same as 1001 in 32 bits, 1008 high and 1009 low word")                                                            \
+  X(CONFIG_CHARGER_LIMIT, 1010, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.charger_limit), "0.001", "A", "16 A",    \
+    "", "The maximum charger current of each charger")                                                                 \
+  X(CONFIG_NUMBER_OF_PHASES, 1011, RW, U16, 1, 3, MB_FIELD(config.lb_config.number_of_phases), "", "", "3", "",        \
+    "Number of phases")                                                                                                \
+  X(CONFIG_ALARM_LIMIT, 1012, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.alarm_limit), "0.001", "A", "24 A", "",    \
+    "Alarm limit current")                                                                                             \
+  X(CONFIG_ALARM_LIMIT_WAIT_TIME, 1013, RW, U16, 0, 0xFE, MB_FIELD(config.lb_config.alarm_limit_wait_time), "1",       \
+    "second", "1 s", "", "Alarm limit wait time")                                                                      \
+  X(CONFIG_ALARM_LIMIT_CHANGE_AMOUNT, 1014, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.alarm_limit_change_amount),  \
+    "0.001", "A", "12.5 A", "", "Alarm limit current change amount")                                                   \
+  X(CONFIG_UPPER_LIMIT, 1015, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.upper_limit), "0.001", "A", "22 A", "",    \
+    "Upper limit current")                                                                                             \
+  X(CONFIG_UPPER_LIMIT_WAIT_TIME, 1016, RW, U16, 0, 0xFE, MB_FIELD(config.lb_config.upper_limit_wait_time), "1",       \
+    "second", "5 s", "", "Upper limit wait time")                                                                      \
+  X(CONFIG_UPPER_LIMIT_CHANGE_AMOUNT, 1017, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.upper_limit_change_amount),  \
+    "0.001", "A", "1 A", "", "Upper limit current change amount")                                                      \
+  X(CONFIG_LOWER_LIMIT, 1018, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.lower_limit), "0.001", "A", "19 A", "",    \
+    "Lower limit current")                                                                                             \
+  X(CONFIG_LOWER_LIMIT_WAIT_TIME, 1019, RW, U16, 0, 0xFE, MB_FIELD(config.lb_config.lower_limit_wait_time), "1",       \
+    "second", "5 s", "", "Lower limit wait time")                                                                      \
+  X(CONFIG_LOWER_LIMIT_CHANGE_AMOUNT, 1020, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.lower_limit_change_amount),  \
+    "0.001", "A", "1 A", "", "Lower limit current change amount")                                                      \
+  X(CONFIG_FALLBACK_LIMIT, 1021, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.fallback_limit), "0.001", "A", "0 A",   \
+    "", "Fallback limit")                                                                                              \
+  X(CONFIG_FALLBACK_LIMIT_WAIT_TIME, 1022, RW, U16, 0, 0xFE, MB_FIELD(config.lb_config.fallback_limit_wait_time), "1", \
+    "second", "30 s", "", "Fallback limit time")                                                                       \
+  X(CONFIG_CURRENT_SOURCE, 1023, RW, U16, 0, DSMR_CURRENT_LAST - 1, MB_FIELD(config.current_source), "", "", "2", "",  \
+    "Grid current source (see below)")                                                                                 \
+  X(CONFIG_CHARGER_KEEPALIVE, 1024, RW, U16, 0, 0xFF, MB_FIELD(config.charger_keepalive), "1", "second", "10 s", "",   \
+    "Write an unchanged charger limit again after (0 = never)")                                                        \
+  X(CONFIG_NUMBER_OF_CHARGERS, 1025, RW, U16, 1, LB_MAX_CHARGERS, MB_FIELD(config.lb_config.number_of_chargers), "",   \
+    "", "1", "", "Number of chargers (1 - 6)")                                                                         \
+  X(CONFIG_LB_POLICY, 1026, RW, U16, 0, LB_POLICY_LAST - 1, MB_FIELD(config.lb_config.policy), "", "", "0", "",        \
+    "Load balancing policy (see below)")                                                                               \
+  X(CONFIG_CHARGER_MIN_CURRENT, 1027, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.charger_min_current), "0.001",     \
+    "A", "6 A", "", "Minimum charger current, below it a charger gets nothing")                                        \
+  X(CONFIG_LB_TRIGGER, 1028, RW, U16, 0, LB_TRIGGER_LAST - 1, MB_FIELD(config.lb_config.trigger), "", "", "0", "",     \
+    "Control step on every telegram (1) or every second (0)")                                                          \
+  X(CONFIG_RESTORE_LIMIT, 1029, RW, U16, 0, 1, MB_FIELD(config.restore_limit), "", "", "0", "",                        \
+    "Start from the limit from before a reset (1) or from 0 (0)")                                                      \
+  X(STAT_TX_BLOCKING_TIME, 1030, R, U16, 0, 0, MB_FIELD(mb_client_ctx.stats.tx_blocking_us), "1", "µs", "", "",        \
+    "Time the last RS485 transmit blocked the main loop")                                                              \
+  X(STAT_TX_BLOCKING_TIME_MAX, 1031, R, U16, 0, 0, MB_FIELD(mb_client_ctx.stats.tx_blocking_max_us), "1", "µs", "",    \
+    "", "Longest time an RS485 transmit blocked the main loop")                                                        \
+  X(STAT_QUEUE_DEPTH, 1032, R, U16, 0, 0, MB_FIELD(mb_client_ctx.stats.queue_depth), "", "", "", "",                   \
+    "Requests queued for the RS485 bus")                                                                               \
+  X(STAT_QUEUE_DEPTH_MAX, 1033, R, U16, 0, 0, MB_FIELD(mb_client_ctx.stats.queue_depth_max), "", "", "", "",           \
+    "Most requests queued for the RS485 bus")                                                                          \
+  X(STAT_QUEUE_DROPPED, 1034, R, U16, 0, 0, MB_FIELD(mb_client_ctx.stats.queue_dropped), "", "", "", "",               \
+    "Requests dropped because the queue was full")                                                                     \
+  X(STAT_QUEUE_COALESCED, 1035, R, U16, 0, 0, MB_FIELD(mb_client_ctx.stats.queue_coalesced), "", "", "", "",           \
+    "Requests replaced by a newer one to the same register")                                                           \
+  X(STAT_RETRIES, 1036, R, U16, 0, 0, MB_FIELD(mb_client_ctx.stats.retries), "", "", "", "",                           \
+    "Requests sent again after a timeout or CRC error")                                                                \
+  X(STAT_CHARGER_WRITES_SENT, 1037, R, U16, 0, 0, MB_FN(get_charger_stat, NULL, 0), "", "", "", "",                    \
+    "Charger limit writes sent (all chargers)")                                                                        \
+  X(STAT_CHARGER_WRITES_SKIPPED, 1038, R, U16, 0, 0, MB_FN(get_charger_stat, NULL, 1), "", "", "", "",                 \
+    "Charger limit writes skipped because the limit was unchanged")                                                    \
+  X(STAT_CHARGER_READBACK_ERRORS, 1039, R, U16, 0, 0, MB_FN(get_charger_stat, NULL, 2), "", "", "", "",                \
+    "Charger limits read back different from the one written")                                                         \
+  X(CONFIG_LB_CONTROLLER, 1040, RW, U16, 0, LB_CONTROLLER_LAST - 1, MB_FIELD(config.lb_config.controller), "", "",     \
+    "0", "", "Controller: hysteresis (0) or PI (1)")                                                                   \
+  X(CONFIG_PI_KP, 1041, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.pi_kp), "0.001", "", "0.1", "",                  \
+    "PI proportional gain")                                                                                            \
+  X(CONFIG_PI_KI, 1042, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.pi_ki), "0.001", "1/s", "0.2", "",               \
+    "PI integral gain")                                                                                                \
+  X(CONFIG_PI_KD, 1043, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.pi_kd), "1", "ms", "500 ms", "",                 \
+    "PI look ahead on the rising load")                                                                                \
+  X(STAT_RAMP_TIME, 1044, R, U16, 0, 0, MB_FN(get_ramp_time, NULL, 0), "0.1", "second", "", "",                        \
+    "Time from the first telegram to the lower limit")                                                                 \
+  X(CONFIG_DEMAND_LIMIT, 1045, RW, U16, 0, 0xFFFF, MB_FIELD(config.lb_config.demand_limit), "0.001", "kW", "0", "",    \
+    "Quarter-hour average power limit (0 = off)")                                                                      \
+  X(AVERAGE_POWER_1S_L1, 1050, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_1S, 0)), "1", "W", "",  \
+    "", "Average power L1 over the last second")                                                                       \
+  X(AVERAGE_POWER_1S_L2, 1051, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_1S, 1)), "1", "W", "",  \
+    "", "Average power L2 over the last second")                                                                       \
+  X(AVERAGE_POWER_1S_L3, 1052, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_1S, 2)), "1", "W", "",  \
+    "", "Average power L3 over the last second")                                                                       \
+  X(AVERAGE_POWER_1S, 1053, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_1S, 3)), "1", "W", "", "", \
+    "Average power of all phases over the last second")                                                                \
+  X(AVERAGE_POWER_1MIN_L1, 1054, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_1MIN, 0)), "1", "W",  \
+    "", "", "Average power L1 over the last minute")                                                                   \
+  X(AVERAGE_POWER_1MIN_L2, 1055, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_1MIN, 1)), "1", "W",  \
+    "", "", "Average power L2 over the last minute")                                                                   \
+  X(AVERAGE_POWER_1MIN_L3, 1056, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_1MIN, 2)), "1", "W",  \
+    "", "", "Average power L3 over the last minute")                                                                   \
+  X(AVERAGE_POWER_1MIN, 1057, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_1MIN, 3)), "1", "W", "", \
+    "", "Average power of all phases over the last minute")                                                            \
+  X(AVERAGE_POWER_15MIN_L1, 1058, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_15MIN, 0)), "1",     \
+    "W", "", "", "Average power L1 over the last 15 minutes")                                                          \
+  X(AVERAGE_POWER_15MIN_L2, 1059, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_15MIN, 1)), "1",     \
+    "W", "", "", "Average power L2 over the last 15 minutes")                                                          \
+  X(AVERAGE_POWER_15MIN_L3, 1060, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_15MIN, 2)), "1",     \
+    "W", "", "", "Average power L3 over the last 15 minutes")                                                          \
+  X(AVERAGE_POWER_15MIN, 1061, R, S16, 0, 0, MB_FN(get_average_power, NULL, MB_INDEX(LB_WINDOW_15MIN, 3)), "1", "W",   \
+    "", "", "Average power of all phases over the last 15 minutes")                                                    \
+  X(CONFIG_ADDRESS, 1090, W, U16, 0, 0xFE, MB_FIELD(config.address), "", "", "10", "",                                 \
+    "Change the modbus server address")                                                                                \
+  X(CONFIG_APPLY, 1091, W, U16, 1, 1, MB_FN(NULL, set_config_apply, 0), "", "", "", "",                                \
+    "Save and apply configuration (write 1)")                                                                          \
+  X(CONFIG_FACTORY_RESET, 1092, W, U16, 1, 1, MB_FN(NULL, set_factory_reset, 0), "", "", "", "",                       \
+    "Restore defaults (write 1)")
+
+// A block of registers per charger at MB_REG_CHARGER_BASE + charger * MB_REG_CHARGER_SIZE
+#define MB_REG_CHARGER_BASE       1100
+#define MB_REG_CHARGER_SIZE       10
+#define MB_REG_CHARGER(n, offset) (MB_REG_CHARGER_BASE + (n)*MB_REG_CHARGER_SIZE + (offset))
+
+#define MB_CHARGER_REGISTERS(X, n)                                                                                     \
+  X(CHARGER_N_ADDRESS, MB_REG_CHARGER(n, 0), RW, U16, 1, 247, MB_FIELD(config.charger_address[n]), "", "", "1", "",    \
+    "Modbus address")                                                                                                  \
+  X(CHARGER_N_PHASE_MAP, MB_REG_CHARGER(n, 1), RW, U16, 0, LB_PHASE_MAP(LB_PHASE_NONE, LB_PHASE_NONE, LB_PHASE_NONE),  \
+    MB_FIELD(config.lb_config.chargers[n].phase_map), "", "", "36", "", "phase map (see below)")                       \
+  X(CHARGER_N_PRIORITY, MB_REG_CHARGER(n, 2), RW, U16, 0, 0xFF, MB_FIELD(config.lb_config.chargers[n].priority), "",   \
+    "", "0", "", "priority, lowest first")                                                                             \
+  X(CHARGER_N_STATE, MB_REG_CHARGER(n, 3), R, U16, 0, 0, MB_FN(get_charger_state, NULL, n), "", "", "", "", "state")   \
+  X(CHARGER_N_CURRENT_L1, MB_REG_CHARGER(n, 4), R, U16, 0, 0, MB_FN(get_charger_current, NULL, MB_INDEX(n, 0)),        \
+    "0.001", "A", "", "", "current L1")                                                                                \
+  X(CHARGER_N_CURRENT_L2, MB_REG_CHARGER(n, 5), R, U16, 0, 0, MB_FN(get_charger_current, NULL, MB_INDEX(n, 1)),        \
+    "0.001", "A", "", "", "current L2")                                                                                \
+  X(CHARGER_N_CURRENT_L3, MB_REG_CHARGER(n, 6), R, U16, 0, 0, MB_FN(get_charger_current, NULL, MB_INDEX(n, 2)),        \
+    "0.001", "A", "", "", "current L3")                                                                                \
+  X(CHARGER_N_LIMIT, MB_REG_CHARGER(n, 7), R, U16, 0, 0, MB_FN(get_charger_limit, NULL, n), "0.001", "A", "", "",      \
+    "limit")
+
+#define MB_CHARGERS(X)       \
+  MB_CHARGER_REGISTERS(X, 0) \
+  MB_CHARGER_REGISTERS(X, 1) \
+  MB_CHARGER_REGISTERS(X, 2) \
+  MB_CHARGER_REGISTERS(X, 3) \
+  MB_CHARGER_REGISTERS(X, 4) \
+  MB_CHARGER_REGISTERS(X, 5)
+_Static_assert(LB_MAX_CHARGERS == 6, "MB_CHARGERS has a block for each charger");
+
+#define MB_REG_FIRST 1000
+#define MB_REG_COUNT (MB_REG_CHARGER(LB_MAX_CHARGERS, 0) - MB_REG_FIRST)
+
+#define MB_REG_ENUM(name, address, ...) MB_REG_##name = (address),
+enum mb_register_address { MB_REGISTERS(MB_REG_ENUM) };
+#undef MB_REG_ENUM
+
+#define MB_ACCESS_R  1
+#define MB_ACCESS_W  2
+#define MB_ACCESS_RW (MB_ACCESS_R | MB_ACCESS_W)
+
+// Two indexes in one, like a charger or window and a phase
+#define MB_INDEX(block, i) ((block)*4 + (i))
+
+struct mb_register {
+  uint8_t access;  // MB_ACCESS_*, 0 when there is no register at the address
+  uint8_t size;  // Of the field, a 32 bit field reads as at most 0xFFFF unless it is a U32 register
+  uint8_t word;  // Of a U32 register, 1 for the high and 2 for the low word
+  uint8_t index;  // For the getter and setter
+  uint16_t min;
+  uint16_t max;
+  void* field;
+  uint16_t (*get)(uint8_t index);
+  enum mb_result (*set)(uint8_t index, uint16_t value);
+};
+
+#define MB_FIELD(f)          .field = &(f), .size = sizeof(f)
+#define MB_FN(get_, set_, i) .get = (get_), .set = (set_), .index = (i)
+
+// The input registers, a copy of the last telegram from the meter that is replaced as a whole by the next one:
+//   X(name, address, type, resolution, unit, description)
+// A 32 bit value takes two registers, the high word first. Values that were not in the telegram are 0.
+#define MB_INPUT_VALUE(msg) (1004 + 2 * (msg))
+
+#define MB_INPUT_REGISTERS(X)                                                                                          \
+  X(METER_SEQUENCE, 1000, U32, "", "", "Telegrams received with a valid CRC")                                          \
+  X(METER_AGE, 1002, U16, "0.1", "second", "Time since the last telegram")                                             \
+  X(METER_PRESENT, 1003, U16, "", "", "Values in the last telegram, bit 0 for 1004 up to bit 13 for 1030")             \
+  X(METER_ACTIVE_IMPORT_1, MB_INPUT_VALUE(MSG_ACTIVE_IMPORT_1), S32, "0.001", "kWh", "Energy imported, tariff 1")      \
+  X(METER_ACTIVE_IMPORT_2, MB_INPUT_VALUE(MSG_ACTIVE_IMPORT_2), S32, "0.001", "kWh", "Energy imported, tariff 2")      \
+  X(METER_VOLTAGE_L1, MB_INPUT_VALUE(MSG_VOLTAGE_L1), S32, "0.001", "V", "Voltage L1")                                 \
+  X(METER_VOLTAGE_L2, MB_INPUT_VALUE(MSG_VOLTAGE_L2), S32, "0.001", "V", "Voltage L2")                                 \
+  X(METER_VOLTAGE_L3, MB_INPUT_VALUE(MSG_VOLTAGE_L3), S32, "0.001", "V", "Voltage L3")                                 \
+  X(METER_CURRENT_L1, MB_INPUT_VALUE(MSG_CURRENT_L1), S32, "0.001", "A", "Current L1")                                 \
+  X(METER_CURRENT_L2, MB_INPUT_VALUE(MSG_CURRENT_L2), S32, "0.001", "A", "Current L2")                                 \
+  X(METER_CURRENT_L3, MB_INPUT_VALUE(MSG_CURRENT_L3), S32, "0.001", "A", "Current L3")                                 \
+  X(METER_POWER_L1, MB_INPUT_VALUE(MSG_POWER_L1), S32, "1", "W", "Power used L1")                                      \
+  X(METER_POWER_L2, MB_INPUT_VALUE(MSG_POWER_L2), S32, "1", "W", "Power used L2")                                      \
+  X(METER_POWER_L3, MB_INPUT_VALUE(MSG_POWER_L3), S32, "1", "W", "Power used L3")                                      \
+  X(METER_POWER_RETURN_L1, MB_INPUT_VALUE(MSG_POWER_RETURN_L1), S32, "1", "W", "Power returned L1")                    \
+  X(METER_POWER_RETURN_L2, MB_INPUT_VALUE(MSG_POWER_RETURN_L2), S32, "1", "W", "Power returned L2")                    \
+  X(METER_POWER_RETURN_L3, MB_INPUT_VALUE(MSG_POWER_RETURN_L3), S32, "1", "W", "Power returned L3")
+_Static_assert(MSG_LAST <= 16, "MB_INPUT_METER_PRESENT has a bit for each value");
+
+#define MB_INPUT_FIRST 1000
+#define MB_INPUT_COUNT (MB_INPUT_VALUE(MSG_LAST) - MB_INPUT_FIRST)
+
+#define MB_INPUT_ENUM(name, address, ...) MB_INPUT_##name = (address),
+enum mb_input_address { MB_INPUT_REGISTERS(MB_INPUT_ENUM) };
+#undef MB_INPUT_ENUM
@@ -0,0 +1,22 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <hardware/uart.h>
+#include <pico/time.h>
+
+// Half duplex RS485 transmit with DMA. The driver enable pin is raised for the transmission and released by an alarm
+// once the UART has shifted out the last stop bit, then tx_done is called from the alarm interrupt.
+struct rs485 {
+  uart_inst_t* uart;
+  uint de_pin;
+  int channel;
+  uint baudrate;
+  uint32_t bit_us;
+  alarm_id_t alarm;
+  void (*tx_done)(void);
+};
+
+void rs485_init(struct rs485* rs, uart_inst_t* uart, uint de_pin, uint baudrate, void (*tx_done)(void));
+void rs485_tx(struct rs485* rs, const uint8_t* data, size_t len);
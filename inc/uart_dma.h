@@ -0,0 +1,19 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <hardware/uart.h>
+
+#include "ringbuf.h"
+
+// Receives a UART into a ring with a DMA channel in ring mode, so the CPU is not interrupted per byte. The ring buffer
+// must be aligned to its size.
+struct uart_dma_rx {
+  uart_inst_t* uart;
+  struct ringbuf* ring;
+  int channel;
+};
+
+void uart_dma_rx_init(struct uart_dma_rx* rx, uart_inst_t* uart, struct ringbuf* ring);
+void uart_dma_rx_poll(struct uart_dma_rx* rx);  // Call from the task before consuming the ring
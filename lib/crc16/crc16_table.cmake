@@ -0,0 +1,69 @@
+# Generates the lookup tables for the reflected CRC16 (polynomial 0xA001) at build time.
+# Usage: cmake -DOUTPUT=<header> -P crc16_table.cmake
+
+set(POLY 0xA001)
+
+function(crc16_bits value bits result)
+    foreach (i RANGE 1 ${bits})
+        math(EXPR value "(${value} >> 1) ^ (${POLY} & -(${value} & 1))")
+    endforeach ()
+    set(${result} ${value} PARENT_SCOPE)
+endfunction()
+
+function(crc16_format_table name list)
+    list(LENGTH list length)
+    set(text "static const uint16_t ${name}[${length}] = {")
+    set(i 0)
+    foreach (value ${list})
+        math(EXPR column "${i} % 8")
+        if (column EQUAL 0)
+            string(APPEND text "\n   ")
+        endif ()
+        math(EXPR value "${value}" OUTPUT_FORMAT HEXADECIMAL)
+        string(SUBSTRING "${value}" 2 -1 digits)
+        string(LENGTH "${digits}" digits_length)
+        while (digits_length LESS 4)
+            set(digits "0${digits}")
+            math(EXPR digits_length "${digits_length} + 1")
+        endwhile ()
+        string(TOUPPER "${digits}" digits)
+        string(APPEND text " 0x${digits},")
+        math(EXPR i "${i} + 1")
+    endforeach ()
+    string(APPEND text "\n};\n")
+    set(CRC16_TABLES "${CRC16_TABLES}\n${text}" PARENT_SCOPE)
+endfunction()
+
+set(CRC16_TABLES "")
+
+set(nibble "")
+foreach (i RANGE 0 15)
+    crc16_bits(${i} 4 value)
+    list(APPEND nibble ${value})
+endforeach ()
+crc16_format_table(crc16_nibble_table "${nibble}")
+
+set(t0 "")
+foreach (i RANGE 0 255)
+    crc16_bits(${i} 8 value)
+    list(APPEND t0 ${value})
+endforeach ()
+crc16_format_table(crc16_table "${t0}")
+
+# Slice-by-4: T[k][i] = (T[k - 1][i] >> 8) ^ T[0][T[k - 1][i] & 0xFF]
+set(previous "${t0}")
+foreach (k RANGE 1 3)
+    set(tk "")
+    foreach (value ${previous})
+        math(EXPR index "${value} & 0xFF")
+        list(GET t0 ${index} low)
+        math(EXPR value "(${value} >> 8) ^ ${low}")
+        list(APPEND tk ${value})
+    endforeach ()
+    crc16_format_table(crc16_slice${k}_table "${tk}")
+    set(previous "${tk}")
+endforeach ()
+
+file(WRITE "${OUTPUT}.tmp" "// Generated by crc16_table.cmake, do not edit.\n\n#pragma once\n\n#include <stdint.h>\n${CRC16_TABLES}")
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different "${OUTPUT}.tmp" "${OUTPUT}")
+file(REMOVE "${OUTPUT}.tmp")
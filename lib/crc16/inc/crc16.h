@@ -0,0 +1,23 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reflected CRC16 with polynomial 0xA001. Seeded with 0xFFFF this is the Modbus CRC, seeded with 0x0000 it is the
+// CRC16/ARC used by DSMR telegrams. The engine used by crc16_update() is selected with CRC16_VARIANT at build time:
+//   BITWISE   no table, 8 shifts per byte
+//   NIBBLE    16 entry table (32 bytes), 2 lookups per byte
+//   TABLE256  256 entry table (512 bytes), 1 lookup per byte
+//   SLICE4    4x256 entry tables (2 KiB), processes 4 bytes per iteration
+
+uint16_t crc16_update(uint16_t crc, const uint8_t* buf, size_t len);
+uint16_t crc16_update_byte(uint16_t crc, uint8_t b);
+
+// All engines are available for benchmarking, unused ones are removed by the linker
+uint16_t crc16_update_bitwise(uint16_t crc, const uint8_t* buf, size_t len);
+uint16_t crc16_update_nibble(uint16_t crc, const uint8_t* buf, size_t len);
+uint16_t crc16_update_table(uint16_t crc, const uint8_t* buf, size_t len);
+uint16_t crc16_update_slice4(uint16_t crc, const uint8_t* buf, size_t len);
@@ -0,0 +1,72 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#include "crc16.h"
+
+#include "crc16_table.h"  // Generated
+
+#define CRC16_POLY 0xA001
+
+uint16_t crc16_update_bitwise(uint16_t crc, const uint8_t* buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)buf[i];
+
+    for (size_t j = 0; j < 8; j++) {
+      if (crc & 0x0001UL) {
+        crc = (crc >> 1U) ^ CRC16_POLY;
+      } else {
+        crc = crc >> 1U;
+      }
+    }
+  }
+  return crc;
+}
+
+uint16_t crc16_update_nibble(uint16_t crc, const uint8_t* buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)buf[i];
+    crc = (crc >> 4U) ^ crc16_nibble_table[crc & 0x0F];
+    crc = (crc >> 4U) ^ crc16_nibble_table[crc & 0x0F];
+  }
+  return crc;
+}
+
+uint16_t crc16_update_table(uint16_t crc, const uint8_t* buf, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    crc = (crc >> 8U) ^ crc16_table[(crc ^ buf[i]) & 0xFF];
+  }
+  return crc;
+}
+
+uint16_t crc16_update_slice4(uint16_t crc, const uint8_t* buf, size_t len) {
+  while (len >= 4) {
+    crc ^= (uint16_t)(buf[0] | (buf[1] << 8U));
+    crc = crc16_slice3_table[crc & 0xFF] ^ crc16_slice2_table[crc >> 8U] ^ crc16_slice1_table[buf[2]] ^
+          crc16_table[buf[3]];
+    buf += 4;
+    len -= 4;
+  }
+  return crc16_update_table(crc, buf, len);
+}
+
+uint16_t crc16_update(uint16_t crc, const uint8_t* buf, size_t len) {
+#if defined(CRC16_VARIANT_BITWISE)
+  return crc16_update_bitwise(crc, buf, len);
+#elif defined(CRC16_VARIANT_NIBBLE)
+  return crc16_update_nibble(crc, buf, len);
+#elif defined(CRC16_VARIANT_SLICE4)
+  return crc16_update_slice4(crc, buf, len);
+#else
+  return crc16_update_table(crc, buf, len);
+#endif
+}
+
+uint16_t crc16_update_byte(uint16_t crc, uint8_t b) {
+#if defined(CRC16_VARIANT_BITWISE)
+  return crc16_update_bitwise(crc, &b, 1);
+#elif defined(CRC16_VARIANT_NIBBLE)
+  return crc16_update_nibble(crc, &b, 1);
+#else
+  return (crc >> 8U) ^ crc16_table[(crc ^ b) & 0xFF];
+#endif
+}
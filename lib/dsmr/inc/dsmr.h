@@ -6,6 +6,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "ringbuf.h"
+
 #define DSMR_RX_BUF_SIZE 128
 enum dsmr_msg {
   MSG_ACTIVE_IMPORT_1,
@@ -19,12 +21,60 @@ enum dsmr_msg {
   MSG_POWER_L1,
   MSG_POWER_L2,
   MSG_POWER_L3,
+  MSG_POWER_RETURN_L1,
+  MSG_POWER_RETURN_L2,
+  MSG_POWER_RETURN_L3,
   MSG_LAST
 };
 
-typedef void (*dsmr_value_cb_t)(enum dsmr_msg obj, float value);
+// Values are scaled integers, the unit follows from the unit suffix in the telegram
+enum dsmr_unit {
+  DSMR_UNIT_NONE,  // No or unknown unit, value * 1000
+  DSMR_UNIT_WH,    // Wh (from kWh)
+  DSMR_UNIT_W,     // W (from kW)
+  DSMR_UNIT_MV,    // mV (from V)
+  DSMR_UNIT_MA,    // mA (from A)
+  DSMR_UNIT_DM3,   // dm3 (from m3)
+};
+
+// All values of one telegram, only published when the telegram CRC is valid
+struct dsmr_telegram {
+  int32_t values[MSG_LAST];
+  uint8_t units[MSG_LAST];  // enum dsmr_unit
+  uint32_t present;  // Bit mask of (1 << dsmr_msg) for the values found in the telegram
+  uint32_t sequence;
+};
+
+// How the phase current is determined from a telegram. The current is negative when the phase returns power.
+enum dsmr_current_source {
+  DSMR_CURRENT_METER = 0,  // The current reported by the meter (whole amps on ESMR5)
+  DSMR_CURRENT_POWER,      // Power / voltage
+  DSMR_CURRENT_FUSED,      // Power / voltage, bounded by the resolution of the current reported by the meter
+  DSMR_CURRENT_LAST
+};
+
+struct dsmr_stats {
+  uint32_t telegrams;
+  uint32_t crc_errors;
+  uint32_t overruns;  // Received bytes dropped because the receive buffer was full
+};
+
+typedef void (*dsmr_value_cb_t)(enum dsmr_msg obj, int32_t value, enum dsmr_unit unit);
+typedef void (*dsmr_telegram_cb_t)(const struct dsmr_telegram* telegram);
 typedef void (*dsmr_forward_cb_t)(char* data, size_t len);
 
-void dsmr_init(dsmr_value_cb_t value_cb, dsmr_forward_cb_t forward_cb);
+struct dsmr_cb {
+  dsmr_value_cb_t value;  // Every parsed line, before the telegram is validated
+  dsmr_telegram_cb_t telegram;
+  dsmr_forward_cb_t forward;
+};
+
+void dsmr_init(struct dsmr_cb* cb);
 void dsmr_rx(char b);
+struct ringbuf* dsmr_rx_ring(void);  // For receiving with DMA instead of dsmr_rx
 void dsmr_task(void);
+const struct dsmr_telegram* dsmr_get_telegram(void);
+const struct dsmr_stats* dsmr_get_stats(void);
+int dsmr_phase_power(const struct dsmr_telegram* telegram, uint8_t phase, int32_t* power);  // W
+int dsmr_phase_current(const struct dsmr_telegram* telegram, uint8_t phase, enum dsmr_current_source source,
+                       int32_t* current);
@@ -6,106 +6,384 @@
 #include <stdbool.h>
 #include <string.h>
 
-#define DSMR_BUF_SIZE  512
+#include "crc16.h"
+#include "ringbuf.h"
+
+#define DSMR_BUF_SIZE  1024  // Power of two, ~90 ms at 115200 baud
 #define DSMR_LINE_SIZE 256
 
+// The meter reports whole amps and may round or truncate, the real current is within this range of the reported one
+#define DSMR_METER_CURRENT_MIN_OFFSET (-500)
+#define DSMR_METER_CURRENT_MAX_OFFSET 999
+
 static char dsmr_line[DSMR_LINE_SIZE];
 static size_t dsmr_line_pos;
-static char dsmr_buf[DSMR_BUF_SIZE];
-static size_t dsmr_buf_head;
-static size_t dsmr_buf_tail;
-static bool dsmr_buf_full;
+static uint8_t dsmr_buf[DSMR_BUF_SIZE] __attribute__((aligned(DSMR_BUF_SIZE)));  // Aligned for DMA ring mode
+static struct ringbuf dsmr_ring;
+static bool dsmr_line_skip;  // The line didn't fit in the line buffer, don't parse the rest of it
+
+static bool dsmr_in_telegram;
+static uint16_t dsmr_crc;
+static struct dsmr_telegram dsmr_pending;
+static struct dsmr_telegram dsmr_telegram;
+static struct dsmr_stats dsmr_stats;
+
+static struct dsmr_cb dsmr_cb;
 
-static dsmr_value_cb_t dsmr_value_cb = NULL;
-static dsmr_forward_cb_t dsmr_forward_cb = NULL;
+// OBIS codes A-B:C.D.E are packed into 32 bits and looked up in a table which is perfect hashed at compile time. The
+// multiplier is chosen so the common ESMR5 objects (not only the ones below) don't collide in 64 slots, a collision
+// is a compile error. For larger tables increase DSMR_OBIS_HASH_BITS and search a new multiplier.
+#define DSMR_OBIS(a, b, c, d, e) \
+  (((uint32_t)(a) << 28) | ((uint32_t)(b) << 24) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 8) | (uint32_t)(e))
+#define DSMR_OBIS_HASH_BITS 6
+#define DSMR_OBIS_HASH_MUL  0x8092B4D5UL
+#define DSMR_OBIS_HASH(key) ((uint32_t)((key)*DSMR_OBIS_HASH_MUL) >> (32 - DSMR_OBIS_HASH_BITS))
+#define DSMR_OBJ(type, a, b, c, d, e) \
+  [DSMR_OBIS_HASH(DSMR_OBIS(a, b, c, d, e))] = {.key = DSMR_OBIS(a, b, c, d, e), .msg = (type), .used = true}
 
-const char* DSMR_OBJ[] = {
+struct dsmr_obj {
+  uint32_t key;
+  uint8_t msg;
+  bool used;
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const struct dsmr_obj DSMR_OBJ_TABLE[1 << DSMR_OBIS_HASH_BITS] = {
     // Mapped to dsmr_msg_t. Other objects will be ignored.
-    "1-0:1.8.1",   // MSG_ACTIVE_IMPORT_1
-    "1-0:1.8.2",   // MSG_ACTIVE_IMPORT_2
-    "1-0:32.7.0",  // MSG_VOLTAGE_L1
-    "1-0:52.7.0",  // MSG_VOLTAGE_L2
-    "1-0:72.7.0",  // MSG_VOLTAGE_L3
-    "1-0:31.7.0",  // MSG_CURRENT_L1
-    "1-0:51.7.0",  // MSG_CURRENT_L2
-    "1-0:71.7.0",  // MSG_CURRENT_L3
-    "1-0:21.7.0",  // MSG_POWER_L1
-    "1-0:41.7.0",  // MSG_POWER_L2
-    "1-0:61.7.0"   // MSG_POWER_L3
+    DSMR_OBJ(MSG_ACTIVE_IMPORT_1, 1, 0, 1, 8, 1),   // 1-0:1.8.1
+    DSMR_OBJ(MSG_ACTIVE_IMPORT_2, 1, 0, 1, 8, 2),   // 1-0:1.8.2
+    DSMR_OBJ(MSG_VOLTAGE_L1, 1, 0, 32, 7, 0),       // 1-0:32.7.0
+    DSMR_OBJ(MSG_VOLTAGE_L2, 1, 0, 52, 7, 0),       // 1-0:52.7.0
+    DSMR_OBJ(MSG_VOLTAGE_L3, 1, 0, 72, 7, 0),       // 1-0:72.7.0
+    DSMR_OBJ(MSG_CURRENT_L1, 1, 0, 31, 7, 0),       // 1-0:31.7.0
+    DSMR_OBJ(MSG_CURRENT_L2, 1, 0, 51, 7, 0),       // 1-0:51.7.0
+    DSMR_OBJ(MSG_CURRENT_L3, 1, 0, 71, 7, 0),       // 1-0:71.7.0
+    DSMR_OBJ(MSG_POWER_L1, 1, 0, 21, 7, 0),         // 1-0:21.7.0
+    DSMR_OBJ(MSG_POWER_L2, 1, 0, 41, 7, 0),         // 1-0:41.7.0
+    DSMR_OBJ(MSG_POWER_L3, 1, 0, 61, 7, 0),         // 1-0:61.7.0
+    DSMR_OBJ(MSG_POWER_RETURN_L1, 1, 0, 22, 7, 0),  // 1-0:22.7.0
+    DSMR_OBJ(MSG_POWER_RETURN_L2, 1, 0, 42, 7, 0),  // 1-0:42.7.0
+    DSMR_OBJ(MSG_POWER_RETURN_L3, 1, 0, 62, 7, 0),  // 1-0:62.7.0
 };
+#pragma GCC diagnostic pop
 
-static int dsmr_parse_line(char* line, enum dsmr_msg* msg_type, float* value) {
-  uint16_t line_len = strlen(line);
-  for (int i = 0; i < MSG_LAST; i++) {
-    uint16_t obj_len = strlen(DSMR_OBJ[i]);
-    if (strncmp(DSMR_OBJ[i], line, line_len > obj_len ? obj_len : line_len) == 0) {
-      char* v = strchr(line, '(') + 1;
-      if (v && dsmr_value_cb) {
-        *value = strtof(v, NULL);
-        *msg_type = i;
-        return 0;
+// Parses one OBIS field terminated by sep. Most lines we're not interested in are rejected on the first few bytes.
+static const char* dsmr_parse_obis_field(const char* p, char sep, uint8_t max, uint32_t* field) {
+  uint32_t value = 0;
+  const char* start = p;
+
+  while (*p >= '0' && *p <= '9') {
+    value = value * 10 + (*p++ - '0');
+    if (value > max) {
+      return NULL;
+    }
+  }
+  if (p == start || *p != sep) {
+    return NULL;
+  }
+  *field = value;
+  return p + 1;
+}
+
+struct dsmr_unit_suffix {
+  const char* suffix;
+  enum dsmr_unit unit;
+};
+
+// Values are parsed with three decimals, so for these units that is the scaled integer directly
+static const struct dsmr_unit_suffix DSMR_UNITS[] = {
+    {"kWh", DSMR_UNIT_WH}, {"kW", DSMR_UNIT_W}, {"V", DSMR_UNIT_MV}, {"A", DSMR_UNIT_MA}, {"m3", DSMR_UNIT_DM3},
+};
+
+// Parses a decimal value like 006184.667*kWh into an integer with three decimals, without floating point.
+static int dsmr_parse_value(const char* p, int32_t* value, enum dsmr_unit* unit) {
+  uint32_t v = 0;
+  int decimals = -1;
+  bool negative = false;
+  bool digits = false;
+
+  if (*p == '-') {
+    negative = true;
+    p++;
+  }
+
+  for (;; p++) {
+    if (*p >= '0' && *p <= '9') {
+      if (decimals < 3) {  // Further decimals are truncated
+        if (v > (INT32_MAX - 9) / 10) {
+          return -1;
+        }
+        v = v * 10 + (*p - '0');
+        if (decimals >= 0) {
+          decimals++;
+        }
       }
+      digits = true;
+    } else if (*p == '.' && decimals < 0) {
+      decimals = 0;
+    } else {
+      break;
     }
   }
-  return -1;
+
+  if (!digits) {
+    return -1;
+  }
+
+  for (decimals = decimals < 0 ? 0 : decimals; decimals < 3; decimals++) {
+    if (v > INT32_MAX / 10) {
+      return -1;
+    }
+    v *= 10;
+  }
+
+  *unit = DSMR_UNIT_NONE;
+  if (*p == '*') {
+    p++;
+    for (size_t i = 0; i < sizeof(DSMR_UNITS) / sizeof(DSMR_UNITS[0]); i++) {
+      size_t len = strlen(DSMR_UNITS[i].suffix);
+      if (strncmp(p, DSMR_UNITS[i].suffix, len) == 0 && p[len] == ')') {
+        *unit = DSMR_UNITS[i].unit;
+        break;
+      }
+    }
+  }
+
+  *value = negative ? -(int32_t)v : (int32_t)v;
+  return 0;
 }
 
-static int dsmr_buf_get(char* data) {
-  if (!(!dsmr_buf_full && (dsmr_buf_head == dsmr_buf_tail))) {
-    *data = dsmr_buf[dsmr_buf_tail];
-    dsmr_buf_full = false;
-    if (++(dsmr_buf_tail) == DSMR_BUF_SIZE) {
-      dsmr_buf_tail = 0;
+static int dsmr_parse_line(const char* line, enum dsmr_msg* msg_type, int32_t* value, enum dsmr_unit* unit) {
+  uint32_t a, b, c, d, e;
+  const char* p = line;
+
+  if (!(p = dsmr_parse_obis_field(p, '-', 0xF, &a)) || !(p = dsmr_parse_obis_field(p, ':', 0xF, &b)) ||
+      !(p = dsmr_parse_obis_field(p, '.', 0xFF, &c)) || !(p = dsmr_parse_obis_field(p, '.', 0xFF, &d)) ||
+      !(p = dsmr_parse_obis_field(p, '(', 0xFF, &e))) {
+    return -1;
+  }
+
+  uint32_t key = DSMR_OBIS(a, b, c, d, e);
+  const struct dsmr_obj* obj = &DSMR_OBJ_TABLE[DSMR_OBIS_HASH(key)];
+  if (!obj->used || obj->key != key) {
+    return -1;
+  }
+
+  if (dsmr_parse_value(p, value, unit)) {
+    return -1;
+  }
+  *msg_type = obj->msg;
+  return 0;
+}
+
+static int dsmr_parse_hex(const char* p, uint16_t* value) {
+  uint16_t v = 0;
+
+  for (int i = 0; i < 4; i++, p++) {
+    v <<= 4;
+    if (*p >= '0' && *p <= '9') {
+      v |= *p - '0';
+    } else if (*p >= 'A' && *p <= 'F') {
+      v |= *p - 'A' + 10;
+    } else if (*p >= 'a' && *p <= 'f') {
+      v |= *p - 'a' + 10;
+    } else {
+      return -1;
     }
-    return 0;
   }
-  return -1;
+  *value = v;
+  return 0;
 }
 
-void dsmr_task(void) {
+static void dsmr_telegram_end(const char* line) {
+  uint16_t crc;
+
+  dsmr_in_telegram = false;
+
+  // The CRC is optional before DSMR 4
+  if (line[1] != '\r' && line[1] != '\n' && line[1] != 0) {
+    if (dsmr_parse_hex(&line[1], &crc) || crc != dsmr_crc) {
+      dsmr_stats.crc_errors++;
+      return;
+    }
+  }
+
+  dsmr_pending.sequence = dsmr_telegram.sequence + 1;
+  dsmr_telegram = dsmr_pending;
+  dsmr_stats.telegrams++;
+  if (dsmr_cb.telegram) {
+    dsmr_cb.telegram(&dsmr_telegram);
+  }
+}
+
+static void dsmr_line_end(size_t len, bool complete) {
   enum dsmr_msg obj;
-  float value;
+  int32_t value;
+  enum dsmr_unit unit;
 
-  while (!dsmr_buf_get(&dsmr_line[dsmr_line_pos])) {
-    if (dsmr_line[dsmr_line_pos] == '\n') {
-      if (dsmr_forward_cb) {
-        dsmr_forward_cb(dsmr_line, dsmr_line_pos + 1);
-      }
+  if (dsmr_cb.forward) {
+    dsmr_cb.forward(dsmr_line, len);
+  }
 
-      dsmr_line[dsmr_line_pos] = 0;
-      if (!dsmr_parse_line(dsmr_line, &obj, &value)) {
-        dsmr_value_cb(obj, value);
-      }
+  if (dsmr_line_skip || !complete) {
+    // Pass the parts of a too long line on and ignore its contents
+    dsmr_line_skip = !complete;
+    if (dsmr_in_telegram) {
+      dsmr_crc = crc16_update(dsmr_crc, (uint8_t*)dsmr_line, len);
+    }
+    return;
+  }
 
-      dsmr_line_pos = 0;
-    } else {
-      if (dsmr_line_pos++ >= DSMR_LINE_SIZE) {
+  if (dsmr_line[0] == '/') {
+    // Start of a new telegram, an unfinished one is dropped
+    dsmr_in_telegram = true;
+    dsmr_crc = 0;
+    memset(&dsmr_pending, 0, sizeof(dsmr_pending));
+  } else if (dsmr_line[0] == '!') {
+    if (dsmr_in_telegram) {
+      dsmr_crc = crc16_update(dsmr_crc, (uint8_t*)dsmr_line, 1);
+      dsmr_line[len] = 0;
+      dsmr_telegram_end(dsmr_line);
+    }
+    return;
+  }
+
+  if (dsmr_in_telegram) {
+    dsmr_crc = crc16_update(dsmr_crc, (uint8_t*)dsmr_line, len);
+  }
+
+  dsmr_line[len] = 0;
+  if (!dsmr_parse_line(dsmr_line, &obj, &value, &unit)) {
+    if (dsmr_cb.value) {
+      dsmr_cb.value(obj, value, unit);
+    }
+    if (dsmr_in_telegram) {
+      dsmr_pending.values[obj] = value;
+      dsmr_pending.units[obj] = unit;
+      dsmr_pending.present |= 1UL << obj;
+    }
+  }
+}
+
+void dsmr_task(void) {
+  const uint8_t* data;
+  size_t len;
+
+  while ((len = ringbuf_read_span(&dsmr_ring, &data)) > 0) {
+    for (size_t i = 0; i < len; i++) {
+      dsmr_line[dsmr_line_pos++] = data[i];
+      if (data[i] == '\n') {
+        dsmr_line_end(dsmr_line_pos, true);
+        dsmr_line_pos = 0;
+      } else if (dsmr_line_pos == DSMR_LINE_SIZE - 1) {
+        dsmr_line_end(dsmr_line_pos, false);
         dsmr_line_pos = 0;
       }
     }
+    ringbuf_commit(&dsmr_ring, len);
   }
 }
 
-void dsmr_init(dsmr_value_cb_t dsmr_value_cb_, dsmr_forward_cb_t dsmr_forward_cb_) {
-  dsmr_value_cb = dsmr_value_cb_;
-  dsmr_forward_cb = dsmr_forward_cb_;
-  dsmr_buf_head = dsmr_buf_tail = 0;
+void dsmr_init(struct dsmr_cb* cb) {
+  dsmr_cb = *cb;
+  ringbuf_init(&dsmr_ring, dsmr_buf, sizeof(dsmr_buf));
   dsmr_line_pos = 0;
-  dsmr_buf_full = false;
+  dsmr_line_skip = false;
+  dsmr_in_telegram = false;
+  memset(&dsmr_telegram, 0, sizeof(dsmr_telegram));
+  memset(&dsmr_stats, 0, sizeof(dsmr_stats));
 }
 
-void dsmr_rx(char data) {
-  dsmr_buf[dsmr_buf_head] = data;
+const struct dsmr_telegram* dsmr_get_telegram(void) {
+  return &dsmr_telegram;
+}
 
-  if (dsmr_buf_full) {
-    if (++(dsmr_buf_tail) == DSMR_BUF_SIZE) {
-      dsmr_buf_tail = 0;
-    }
+const struct dsmr_stats* dsmr_get_stats(void) {
+  dsmr_stats.overruns = ringbuf_overruns(&dsmr_ring);
+  return &dsmr_stats;
+}
+
+static bool dsmr_has(const struct dsmr_telegram* telegram, enum dsmr_msg msg) {
+  return telegram->present & (1UL << msg);
+}
+
+// Net phase power in W, negative when returning power
+int dsmr_phase_power(const struct dsmr_telegram* telegram, uint8_t phase, int32_t* power) {
+  enum dsmr_msg power_msg = MSG_POWER_L1 + phase;
+  enum dsmr_msg power_return_msg = MSG_POWER_RETURN_L1 + phase;
+
+  if (phase > 2 || !dsmr_has(telegram, power_msg)) {
+    return -1;
+  }
+  *power = telegram->values[power_msg];
+  if (dsmr_has(telegram, power_return_msg)) {
+    *power -= telegram->values[power_return_msg];
+  }
+  return 0;
+}
+
+// Signed net phase current in mA. P / U gives ~4 mA resolution where the meter reports whole amps.
+int dsmr_phase_current(const struct dsmr_telegram* telegram, uint8_t phase, enum dsmr_current_source source,
+                       int32_t* current) {
+  enum dsmr_msg current_msg = MSG_CURRENT_L1 + phase;
+  enum dsmr_msg voltage_msg = MSG_VOLTAGE_L1 + phase;
+  int32_t power = 0;  // W, net import
+  int32_t estimate = 0;
+
+  if (phase > 2) {
+    return -1;
+  }
+
+  bool has_meter_current = dsmr_has(telegram, current_msg);
+  bool has_power = !dsmr_phase_power(telegram, phase, &power);
+  bool has_estimate = has_power && dsmr_has(telegram, voltage_msg) && telegram->values[voltage_msg] > 0;
+
+  if (has_estimate) {
+    // W / mV -> mA
+    estimate = (int32_t)((int64_t)power * 1000000 / telegram->values[voltage_msg]);
   }
 
-  if (++(dsmr_buf_head) == DSMR_BUF_SIZE) {
-    dsmr_buf_head = 0;
+  switch (source) {
+    case DSMR_CURRENT_POWER:
+      if (has_estimate) {
+        *current = estimate;
+        return 0;
+      }
+      break;
+    case DSMR_CURRENT_FUSED:
+      if (has_estimate && has_meter_current) {
+        // P / U underestimates the current with a poor power factor, so stay within what the meter reports
+        int32_t meter = telegram->values[current_msg];
+        int32_t magnitude = estimate < 0 ? -estimate : estimate;
+        if (magnitude < meter + DSMR_METER_CURRENT_MIN_OFFSET) {
+          magnitude = meter + DSMR_METER_CURRENT_MIN_OFFSET;
+        } else if (magnitude > meter + DSMR_METER_CURRENT_MAX_OFFSET) {
+          magnitude = meter + DSMR_METER_CURRENT_MAX_OFFSET;
+        }
+        if (magnitude < 0) {
+          magnitude = 0;
+        }
+        *current = power < 0 ? -magnitude : magnitude;
+        return 0;
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (has_meter_current) {
+    // The meter only reports the magnitude, the direction follows from the power
+    *current = power < 0 ? -telegram->values[current_msg] : telegram->values[current_msg];
+    return 0;
   }
+  return -1;
+}
 
-  dsmr_buf_full = (dsmr_buf_head == dsmr_buf_tail);
-}
\ No newline at end of file
+struct ringbuf* dsmr_rx_ring(void) {
+  return &dsmr_ring;
+}
+
+void dsmr_rx(char data) {  // Interrupt
+  ringbuf_put(&dsmr_ring, data);
+}
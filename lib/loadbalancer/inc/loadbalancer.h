@@ -3,14 +3,56 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define LB_MAX_CHARGERS 6
+
 enum lb_phase {
   LB_PHASE_1 = 0,
   LB_PHASE_2,
   LB_PHASE_3,
+  LB_PHASE_NONE,  // Charger phase not connected
+};
+
+// Grid phase each charger phase (L1, L2, L3) is connected to, two bits per phase
+#define LB_PHASE_MAP(l1, l2, l3)  ((l1) | (l2) << 2 | (l3) << 4)
+#define LB_PHASE_MAP_GET(map, i)  ((enum lb_phase)((map) >> ((i) * 2) & 0x3))
+#define LB_PHASE_MAP_DEFAULT      LB_PHASE_MAP(LB_PHASE_1, LB_PHASE_2, LB_PHASE_3)
+
+// What runs the control step
+enum lb_trigger {
+  LB_TRIGGER_TIMER = 0,   // Every second
+  LB_TRIGGER_GRID_UPDATE,  // Every lb_commit_grid_current, and every second without updates
+  LB_TRIGGER_LAST,
+};
+
+// What decides the current available for the chargers
+enum lb_controller {
+  LB_CONTROLLER_HYSTERESIS = 0,  // Change amounts after wait times, by the band of the grid current
+  LB_CONTROLLER_PI,              // Proportional-integral with trend, the alarm band and fallback stay hysteresis
+  LB_CONTROLLER_LAST,
+};
+
+// How the current available for charging is shared between the chargers
+enum lb_policy {
+  LB_POLICY_EQUAL = 0,   // Equal share, as far as the phases allow
+  LB_POLICY_PRIORITY,    // Lowest priority value first
+  LB_POLICY_FIRST_COME,  // Vehicle that started first, first
+  LB_POLICY_LAST,
+};
+
+// Averages of the grid power, the longest fits LB_DEMAND_SECONDS
+enum lb_window {
+  LB_WINDOW_1S = 0,
+  LB_WINDOW_1MIN,
+  LB_WINDOW_15MIN,
+  LB_WINDOW_STAYING,  // The quarter-hour without the minute that leaves it next, for the demand limit
+  LB_WINDOW_LAST,
 };
 
+#define LB_DEMAND_SECONDS 900
+
 enum lb_state {
   LB_STATE_NORMAL = 0,
   LB_STATE_LOWER_LIMIT,
@@ -34,14 +76,100 @@ struct lb_config {
   uint16_t lower_limit_change_amount;
   uint16_t fallback_limit;
   uint8_t fallback_limit_wait_time;
+  uint8_t number_of_chargers;
+  uint8_t policy;                // enum lb_policy
+  uint16_t charger_min_current;  // Below this a charger gets nothing, so the others get more
+  uint8_t trigger;               // enum lb_trigger
+  uint8_t controller;            // enum lb_controller
+  uint16_t pi_kp;                // 0.001
+  uint16_t pi_ki;                // 0.001 per second
+  uint16_t pi_kd;                // ms the grid current trend is looked ahead
+  uint16_t demand_limit;         // W, quarter-hour average of all phases together, 0 is off
+  struct lb_charger_config {
+    uint8_t phase_map;  // LB_PHASE_MAP
+    uint8_t priority;
+  } chargers[LB_MAX_CHARGERS];
+};
+
+struct lb_context;
+
+typedef void (*lb_limit_charger_cb_t)(struct lb_context* ctx, uint8_t charger, uint16_t current);
+
+struct lb_charger {
+  uint16_t current[3];  // mA, by charger phase
+  uint16_t limit;
+  uint8_t rank;  // Order in which the active chargers became active starting at 1, 0 when inactive
+  uint8_t feedback;  // LB_UPDATE_*
+  uint32_t feedback_time;
 };
 
-typedef void (*lb_limit_charger_cb_t)(uint16_t current);
+// State of the PI controller, between steps
+struct lb_pi {
+  int32_t integral;   // mA
+  int32_t last_load;  // mA, load on the worst phase of the previous step
+  bool load_feedback;  // last_load is the household load, else the grid current
+  uint32_t raise_time;  // ms the output last rose
+  uint32_t time;
+  bool running;  // False while the hysteresis controller has the charger limit
+};
+
+// Power of every second in a ring, the sum of a window changes by what enters and what leaves it
+struct lb_demand {
+  int16_t power[LB_DEMAND_SECONDS][3];  // W, by grid phase
+  int32_t sum[LB_WINDOW_LAST][3];
+  uint16_t head;  // Second written next
+  uint16_t filled;  // Seconds written, up to LB_DEMAND_SECONDS
+  int32_t next[3];  // W, set but not committed
+  bool update;
+  int32_t hold[3];  // W, the last measurement, it holds until the next one
+  uint32_t time;  // ms the second written next started
+  bool valid;
+  int32_t cap;  // mA, the charger limit the demand limit allows
+};
+
+// One load balancer, for the chargers behind one grid connection
+struct lb_context {
+  struct lb_config config;
+  lb_limit_charger_cb_t limit_charger_cb;
+  int32_t grid_current[3];
+  uint8_t grid_update;  // LB_UPDATE_*
+  uint32_t grid_time;
+  struct lb_charger chargers[LB_MAX_CHARGERS];
+  uint8_t active_count;
+  uint8_t next_charger;  // First to get its limit on the next check
+  int32_t charger_max_current;  // For all chargers together on each phase, up to 6 x charger_limit
+  int32_t start_limit;  // Taken over by the first measurement if the grid allows it, 0 for none
+  enum lb_state state;
+  uint32_t state_time;  // ms the state was entered or last acted on
+  bool state_acted;
+  uint32_t check_time;
+  bool checked;
+  uint32_t ramp_start;  // ms of the last start
+  uint32_t ramp_time;   // ms the last start took to reach the lower limit or the chargers' maximum
+  bool ramping;
+  struct lb_pi pi;
+  int charger_limit_override;  // mA for all chargers together on each phase, the sum of their limits until set
+  struct lb_demand demand;
+};
 
-void lb_init(struct lb_config* config, lb_limit_charger_cb_t cb);
-void lb_set_grid_current(enum lb_phase phase, uint16_t current);
-void lb_set_charger_limit_override(uint16_t limit);
-uint16_t lb_get_charger_limit_override(void);
-enum lb_state lb_get_state(void);
-uint16_t lb_get_limit(void);
-void lb_task(uint32_t current_time);
+void lb_init(struct lb_context* ctx, struct lb_config* config, lb_limit_charger_cb_t limit_charger_cb);
+// Starts from this on the first measurement if the grid current allows it, like a limit from before a reset. Until then
+// the chargers get nothing, as the grid current is not known yet.
+void lb_set_start_limit(struct lb_context* ctx, uint32_t limit);
+void lb_set_grid_current(struct lb_context* ctx, enum lb_phase phase, int32_t current);  // mA, negative when returning
+void lb_set_grid_power(struct lb_context* ctx, enum lb_phase phase, int32_t power);  // W, negative when returning
+void lb_commit_grid_current(struct lb_context* ctx, uint32_t current_time);  // All phases of one measurement are set
+// mA, as measured by the charger on its own phase L1, L2 or L3
+void lb_set_charger_current(struct lb_context* ctx, uint8_t charger, enum lb_phase phase, int32_t current);
+// Only active chargers get a share, all are at start
+void lb_set_charger_active(struct lb_context* ctx, uint8_t charger, bool active);
+void lb_set_charger_limit_override(struct lb_context* ctx, uint16_t limit);
+uint16_t lb_get_charger_limit_override(struct lb_context* ctx);
+enum lb_state lb_get_state(struct lb_context* ctx);
+uint32_t lb_get_limit(struct lb_context* ctx);  // Current available for all chargers together on each phase
+uint16_t lb_get_charger_limit(struct lb_context* ctx, uint8_t charger);
+// ms from the first measurement to the lower limit (or the chargers' maximum)
+uint32_t lb_get_ramp_time(struct lb_context* ctx);
+// W, over the window, LB_PHASE_NONE for all phases together
+int32_t lb_get_average_power(struct lb_context* ctx, enum lb_window window, enum lb_phase phase);
+void lb_task(struct lb_context* ctx, uint32_t current_time);
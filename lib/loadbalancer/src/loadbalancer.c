@@ -3,94 +3,586 @@
 
 #include "loadbalancer.h"
 
+#include <stdbool.h>
 #include <string.h>
 
-#define WAIT_TIME_UNSET   0xFF
-#define CHECK_INTERVAL_MS 1000
+#define CHECK_INTERVAL_MS        1000
+#define PI_FOLLOW_TIME           5000  // ms the vehicles may take to draw a raised limit
+#define CHARGER_FEEDBACK_TIMEOUT 5000  // ms the measured charger current stays valid
+#define NOMINAL_VOLTAGE          230   // V, turns the power budget of the demand limit into current
+#define DEMAND_DEADBAND          100   // mA the demand limit moves at least while it holds the charger limit
+
+// Measurements are timestamped by the next check
+#define LB_UPDATE_NONE  0
+#define LB_UPDATE_NEW   1
+#define LB_UPDATE_VALID 2
+
+static const uint16_t window_seconds[LB_WINDOW_LAST] = {1, 60, LB_DEMAND_SECONDS, LB_DEMAND_SECONDS - 60};
+
+// Most the chargers can draw together on one phase, going higher has no effect
+static int32_t get_total_charger_limit(struct lb_context* ctx) {
+  int32_t total[3] = {0};
+  int32_t max = 0;
+
+  for (uint8_t i = 0; i < ctx->config.number_of_chargers; i++) {
+    for (int c = 0; c < 3; c++) {
+      enum lb_phase phase = LB_PHASE_MAP_GET(ctx->config.chargers[i].phase_map, c);
+      if (phase != LB_PHASE_NONE) {
+        total[phase] += ctx->config.charger_limit;
+      }
+    }
+  }
+  for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+    if (total[phase] > max) {
+      max = total[phase];
+    }
+  }
+  return max;
+}
+
+void lb_init(struct lb_context* ctx, struct lb_config* config, lb_limit_charger_cb_t limit_charger_cb) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->config = *config;
+  if (ctx->config.number_of_chargers > LB_MAX_CHARGERS) {
+    ctx->config.number_of_chargers = LB_MAX_CHARGERS;
+  }
+  ctx->limit_charger_cb = limit_charger_cb;
+  for (uint8_t i = 0; i < ctx->config.number_of_chargers; i++) {
+    ctx->chargers[i].rank = i + 1;
+  }
+  ctx->active_count = ctx->config.number_of_chargers;
+  ctx->state = LB_STATE_FALLBACK;  // Until the first measurement
+  ctx->grid_update = LB_UPDATE_NONE;
+  ctx->charger_max_current = 0;  // We start at zero and gradually go up
 
-static struct lb_config config;
-static lb_limit_charger_cb_t lb_limit_charger_cb;
-static uint16_t grid_current[3];
-static int charger_max_current;
-static enum lb_state state;
-static uint8_t wait_time, fallback_time;
-static int charger_limit_override;
+  ctx->charger_limit_override = get_total_charger_limit(ctx);
+}
 
-void lb_init(struct lb_config* config_, lb_limit_charger_cb_t lb_limit_charger_cb_) {
-  config = *config_;
-  lb_limit_charger_cb = lb_limit_charger_cb_;
-  memset(grid_current, 0, sizeof(grid_current));
-  state = LB_STATE_NORMAL;
-  wait_time = WAIT_TIME_UNSET;
-  fallback_time = 0;
-  charger_max_current = 0;  // We start at zero and gradually go up
+void lb_set_start_limit(struct lb_context* ctx, uint32_t limit) {
+  ctx->start_limit = limit;
+}
+
+void lb_set_grid_current(struct lb_context* ctx, enum lb_phase phase, int32_t current) {
+  ctx->grid_current[phase] = current;
+  ctx->grid_update = LB_UPDATE_NEW;
+}
 
-  charger_limit_override = config_->charger_limit;
+void lb_set_grid_power(struct lb_context* ctx, enum lb_phase phase, int32_t power) {
+  ctx->demand.next[phase] = power;
+  ctx->demand.update = true;
 }
 
-void lb_set_grid_current(enum lb_phase phase, uint16_t current) {
-  grid_current[phase] = current;
-  fallback_time = config.fallback_limit_wait_time;
+void lb_set_charger_current(struct lb_context* ctx, uint8_t charger, enum lb_phase phase, int32_t current) {
+  if (charger >= ctx->config.number_of_chargers) {
+    return;
+  }
+  ctx->chargers[charger].current[phase] = current < 0 ? 0 : current > UINT16_MAX ? UINT16_MAX : current;
+  ctx->chargers[charger].feedback = LB_UPDATE_NEW;
+}
+
+void lb_set_charger_active(struct lb_context* ctx, uint8_t charger, bool active) {
+  if (charger >= ctx->config.number_of_chargers || active == (ctx->chargers[charger].rank != 0)) {
+    return;
+  }
+  if (active) {
+    ctx->chargers[charger].rank = ++ctx->active_count;
+    return;
+  }
+  for (uint8_t i = 0; i < ctx->config.number_of_chargers; i++) {
+    if (ctx->chargers[i].rank > ctx->chargers[charger].rank) {
+      ctx->chargers[i].rank--;
+    }
+  }
+  ctx->chargers[charger].rank = 0;
+  ctx->active_count--;
 }
 
-void lb_set_charger_limit_override(uint16_t limit) {
-  charger_limit_override = limit;
+void lb_set_charger_limit_override(struct lb_context* ctx, uint16_t limit) {
+  ctx->charger_limit_override = limit;
 }
 
-uint16_t lb_get_charger_limit_override(void) {
-  return charger_limit_override;
+uint16_t lb_get_charger_limit_override(struct lb_context* ctx) {
+  return ctx->charger_limit_override < 0xFFFF ? ctx->charger_limit_override : 0xFFFF;
 }
 
-static uint16_t get_max_grid_current(void) {
-  uint16_t max = 0;
-  for (enum lb_phase phase = 0; phase < config.number_of_phases; phase++) {
-    if (grid_current[phase] > max) {
-      max = grid_current[phase];
+static int32_t get_max_grid_current(struct lb_context* ctx) {
+  // Returned power is negative current, so this is the phase with the least headroom
+  int32_t max = ctx->grid_current[LB_PHASE_1];
+  for (enum lb_phase phase = LB_PHASE_2; phase < ctx->config.number_of_phases; phase++) {
+    if (ctx->grid_current[phase] > max) {
+      max = ctx->grid_current[phase];
     }
   }
   return max;
 }
 
-static void set_state(enum lb_state state_) {
-  if (state != state_) {
-    state = state_;
-    wait_time = WAIT_TIME_UNSET;
+// With the current the chargers draw the household load is known, so the charger limit that brings the grid current
+// halfway between the lower and upper limit can be set in one step. Returns false without recent feedback of every
+// charger.
+static bool get_target_limit(struct lb_context* ctx, int32_t* limit, uint32_t now) {
+  int32_t base[3];
+
+  memcpy(base, ctx->grid_current, sizeof(base));
+  for (uint8_t i = 0; i < ctx->config.number_of_chargers; i++) {
+    if (ctx->chargers[i].feedback != LB_UPDATE_VALID ||
+        now - ctx->chargers[i].feedback_time >= CHARGER_FEEDBACK_TIMEOUT) {
+      return false;
+    }
+    for (int c = 0; c < 3; c++) {
+      enum lb_phase phase = LB_PHASE_MAP_GET(ctx->config.chargers[i].phase_map, c);
+      if (phase != LB_PHASE_NONE) {
+        base[phase] -= ctx->chargers[i].current[c];
+      }
+    }
+  }
+
+  int32_t base_max = base[LB_PHASE_1];
+  for (enum lb_phase phase = LB_PHASE_2; phase < ctx->config.number_of_phases; phase++) {
+    if (base[phase] > base_max) {
+      base_max = base[phase];
+    }
+  }
+  *limit = (ctx->config.lower_limit + ctx->config.upper_limit) / 2 - base_max;
+  return true;
+}
+
+// Active chargers in the order they are served, the first is the last to be dropped below the minimum current
+static uint8_t get_charger_order(struct lb_context* ctx, uint8_t* order) {
+  uint8_t count = 0;
+
+  for (uint8_t i = 0; i < ctx->config.number_of_chargers; i++) {
+    if (ctx->chargers[i].rank == 0) {
+      continue;
+    }
+    uint8_t j = count++;
+    for (; j > 0; j--) {
+      uint8_t prev = order[j - 1];
+      int diff = 0;
+      if (ctx->config.policy == LB_POLICY_PRIORITY) {
+        diff = ctx->config.chargers[prev].priority - ctx->config.chargers[i].priority;
+      }
+      if (diff < 0 || (diff == 0 && ctx->chargers[prev].rank < ctx->chargers[i].rank)) {
+        break;
+      }
+      order[j] = prev;
+    }
+    order[j] = i;
+  }
+  return count;
+}
+
+// Least of what is left on the phases of a charger, divided by the chargers still sharing each phase
+static int32_t get_phase_share(struct lb_context* ctx, uint8_t charger, const int32_t* remaining,
+                               const uint8_t* users) {
+  int32_t share = INT32_MAX;
+
+  for (int c = 0; c < 3; c++) {
+    enum lb_phase phase = LB_PHASE_MAP_GET(ctx->config.chargers[charger].phase_map, c);
+    if (phase != LB_PHASE_NONE && remaining[phase] / users[phase] < share) {
+      share = remaining[phase] / users[phase];
+    }
+  }
+  return share;
+}
+
+static void take_phase_share(struct lb_context* ctx, uint8_t charger, int32_t* remaining, int32_t amount) {
+  for (int c = 0; c < 3; c++) {
+    enum lb_phase phase = LB_PHASE_MAP_GET(ctx->config.chargers[charger].phase_map, c);
+    if (phase != LB_PHASE_NONE) {
+      remaining[phase] -= amount;
+    }
+  }
+}
+
+// Each charger in turn takes what it can get
+static void share_in_order(struct lb_context* ctx, const uint8_t* order, uint8_t count, int32_t* remaining,
+                           int32_t max, int32_t* limit) {
+  const uint8_t users[3] = {1, 1, 1};
+
+  for (uint8_t i = 0; i < count; i++) {
+    int32_t share = get_phase_share(ctx, order[i], remaining, users);
+    if (share > max) {
+      share = max;
+    }
+    if (share < ctx->config.charger_min_current) {
+      share = 0;
+    }
+    limit[order[i]] = share;
+    take_phase_share(ctx, order[i], remaining, share);
+  }
+}
+
+// Raises the limits of all chargers together, until a charger reaches its maximum or one of its phases is used up.
+// Every round stops at least one charger.
+static void fill_equal(struct lb_context* ctx, const uint8_t* order, uint8_t count, int32_t* remaining, int32_t max,
+                       int32_t* limit) {
+  bool filling[LB_MAX_CHARGERS];
+  uint8_t filling_count = count;
+
+  for (uint8_t i = 0; i < count; i++) {
+    filling[i] = true;
+    limit[order[i]] = 0;
+  }
+
+  while (filling_count) {
+    uint8_t users[3] = {0};
+    int32_t step = max;
+
+    for (uint8_t i = 0; i < count; i++) {
+      if (filling[i]) {
+        for (int c = 0; c < 3; c++) {
+          enum lb_phase phase = LB_PHASE_MAP_GET(ctx->config.chargers[order[i]].phase_map, c);
+          if (phase != LB_PHASE_NONE) {
+            users[phase]++;
+          }
+        }
+      }
+    }
+    for (uint8_t i = 0; i < count; i++) {
+      if (filling[i]) {
+        int32_t share = get_phase_share(ctx, order[i], remaining, users);
+        if (share > max - limit[order[i]]) {
+          share = max - limit[order[i]];
+        }
+        if (share < step) {
+          step = share;
+        }
+      }
+    }
+    for (uint8_t i = 0; i < count; i++) {
+      if (filling[i]) {
+        limit[order[i]] += step;
+        take_phase_share(ctx, order[i], remaining, step);
+      }
+    }
+    for (uint8_t i = 0; i < count; i++) {
+      if (filling[i] && (limit[order[i]] >= max || get_phase_share(ctx, order[i], remaining, users) == 0)) {
+        filling[i] = false;
+        filling_count--;
+      }
+    }
+  }
+}
+
+// Shares equally, but when that leaves chargers below the minimum current the last one of those in the order gets
+// nothing, so the others get more
+static void share_equal(struct lb_context* ctx, const uint8_t* order, uint8_t count, const int32_t* remaining,
+                        int32_t max, int32_t* limit) {
+  uint8_t sharing[LB_MAX_CHARGERS];
+  uint8_t sharing_count = count;
+
+  memcpy(sharing, order, count);
+  while (sharing_count) {
+    int32_t left[3];
+    int drop = -1;
+
+    memcpy(left, remaining, sizeof(left));
+    fill_equal(ctx, sharing, sharing_count, left, max, limit);
+    for (uint8_t i = 0; i < sharing_count; i++) {
+      if (limit[sharing[i]] < ctx->config.charger_min_current) {
+        drop = i;
+      }
+    }
+    if (drop < 0) {
+      return;
+    }
+    limit[sharing[drop]] = 0;
+    memmove(&sharing[drop], &sharing[drop + 1], sharing_count - drop - 1);
+    sharing_count--;
+  }
+}
+
+// Divides the current available on each phase over the active chargers by the policy. The limits are handed out
+// round-robin, lowered limits first, so the bus never has a raised limit waiting behind a lowered one.
+static void share_charger_limit(struct lb_context* ctx) {
+  int32_t limit[LB_MAX_CHARGERS] = {0};
+  int32_t remaining[3] = {ctx->charger_max_current, ctx->charger_max_current, ctx->charger_max_current};
+  int32_t max = ctx->config.charger_limit;
+  uint8_t order[LB_MAX_CHARGERS];
+  uint8_t count = get_charger_order(ctx, order);
+
+  if (ctx->config.policy == LB_POLICY_EQUAL) {
+    share_equal(ctx, order, count, remaining, max, limit);
+  } else {
+    share_in_order(ctx, order, count, remaining, max, limit);
+  }
+
+  for (int raise = 0; raise < 2; raise++) {
+    for (uint8_t n = 0; n < ctx->config.number_of_chargers; n++) {
+      uint8_t i = (ctx->next_charger + n) % ctx->config.number_of_chargers;
+      if ((limit[i] > ctx->chargers[i].limit) != raise) {
+        continue;
+      }
+      ctx->chargers[i].limit = limit[i];
+      if (ctx->limit_charger_cb) {
+        ctx->limit_charger_cb(ctx, i, ctx->chargers[i].limit);
+      }
+    }
+  }
+  if (ctx->config.number_of_chargers) {
+    ctx->next_charger = (ctx->next_charger + 1) % ctx->config.number_of_chargers;
+  }
+}
+
+static void set_state(struct lb_context* ctx, enum lb_state state_, uint32_t now) {
+  if (ctx->state != state_) {
+    ctx->state = state_;
+    ctx->state_time = now;
+    ctx->state_acted = false;
+  }
+}
+
+// Keeps the timing of the wait counted in one second checks: the state acts once the wait time has passed since it
+// was entered, at least a second, and every wait time plus a second after that. Half a check of margin keeps the
+// telegram jitter from adding a whole check.
+static bool state_wait_done(struct lb_context* ctx, uint8_t wait_time, uint32_t now) {
+  uint32_t wait = (wait_time ? wait_time : 1) * 1000u + (ctx->state_acted ? 1000u : 0) - CHECK_INTERVAL_MS / 2;
+
+  if (now - ctx->state_time < wait) {
+    return false;
+  }
+  ctx->state_time = now;
+  ctx->state_acted = true;
+  return true;
+}
+
+// Most the chargers can get without going over the middle of the lower and upper limit on any of their phases, if they
+// all draw their limit. What the chargers are not drawing of their limit is not counted as room, a charger that can't
+// start below the minimum current would otherwise take it at once when the output crawls up to it.
+static int32_t get_headroom_limit(struct lb_context* ctx) {
+  int32_t booked[3] = {0};
+  bool used[3] = {false};
+  int32_t limit = INT32_MAX;
+
+  for (uint8_t i = 0; i < ctx->config.number_of_chargers; i++) {
+    for (int c = 0; c < 3; c++) {
+      enum lb_phase phase = LB_PHASE_MAP_GET(ctx->config.chargers[i].phase_map, c);
+      if (phase != LB_PHASE_NONE) {
+        booked[phase] += ctx->chargers[i].limit;
+        used[phase] = true;
+      }
+    }
+  }
+  for (enum lb_phase phase = LB_PHASE_1; phase < ctx->config.number_of_phases; phase++) {
+    int32_t headroom = (ctx->config.lower_limit + ctx->config.upper_limit) / 2 - ctx->grid_current[phase];
+    if (used[phase] && booked[phase] + headroom < limit) {
+      limit = booked[phase] + headroom;
+    }
+  }
+  return limit;
+}
+
+// One step of the PI controller on a new measurement. The error is the headroom of the worst phase to the middle of the
+// lower and upper limit. A rising load is subtracted ahead of time, the household load with charger feedback and the
+// grid current without once the vehicles had time to follow the last raise. The output rises by at most the lower
+// limit change amount per second, so the vehicles can follow before the next step, and never beyond the headroom.
+// The integral stops while the output is held back by a bound, and starts from the current limit when the PI
+// controller takes over.
+static void lb_pi_step(struct lb_context* ctx, int32_t grid_current_max, int32_t upper, bool feedback,
+                       int32_t target_limit, uint32_t now) {
+  int32_t error = (ctx->config.lower_limit + ctx->config.upper_limit) / 2 - grid_current_max;
+  int32_t headroom_limit = get_headroom_limit(ctx);
+  int32_t load = feedback ? (ctx->config.lower_limit + ctx->config.upper_limit) / 2 - target_limit : grid_current_max;
+  uint32_t dt = ctx->pi.running ? now - ctx->pi.time : CHECK_INTERVAL_MS;
+  int32_t p = error * ctx->config.pi_kp / 1000;
+  int32_t d = 0;
+  int32_t rise = (int32_t)(ctx->config.lower_limit_change_amount * dt / 1000);
+  int32_t trend = ctx->pi.running && ctx->pi.load_feedback == feedback ? load - ctx->pi.last_load : 0;
+  int32_t integral;
+  int32_t output;
+
+  if (!ctx->pi.running) {
+    ctx->pi.integral = ctx->charger_max_current;
+    ctx->pi.raise_time = now;
+  } else if (!feedback && now - ctx->pi.raise_time < PI_FOLLOW_TIME) {
+    trend = 0;  // The grid current may still rise with the vehicles
+  } else if (dt > 0 && trend > 0) {
+    d = -(int32_t)((int64_t)trend * ctx->config.pi_kd / (int32_t)dt);
+  }
+  if (ctx->charger_max_current + rise < upper) {
+    upper = ctx->charger_max_current + rise;
+  }
+  if (headroom_limit < upper) {
+    upper = headroom_limit;
+  }
+
+  integral = ctx->pi.integral + (int32_t)((int64_t)error * ctx->config.pi_ki * dt / 1000000);
+  output = integral + p + d;
+  if (output >= upper) {
+    output = upper < 0 ? 0 : upper;
+    if (error > 0) {
+      integral = ctx->pi.integral;  // Anti-windup
+    }
+  } else if (output <= 0) {
+    output = 0;
+    if (error < 0) {
+      integral = ctx->pi.integral;
+    }
+  }
+  ctx->pi.integral = integral < 0 ? 0 : integral > output + rise ? output + rise : integral;
+  ctx->pi.running = true;
+  ctx->pi.time = now;
+  ctx->pi.load_feedback = feedback;
+  ctx->pi.last_load = load;
+  if (output > ctx->charger_max_current) {
+    ctx->pi.raise_time = now;
+  }
+  ctx->charger_max_current = output;
+}
+
+// On the first measurement after the start or a fallback the limit is set to what the headroom allows at once, instead
+// of climbing up from zero. Without feedback what the chargers draw is counted as household load, which errs on the
+// safe side. The start limit, only on the first measurement, or the fallback limit is kept when the grid current is not
+// above the upper limit with it.
+static void lb_warm_start(struct lb_context* ctx, int32_t grid_current_max, bool feedback, int32_t target_limit,
+                          uint32_t now) {
+  int32_t limit = feedback ? target_limit : (ctx->config.lower_limit + ctx->config.upper_limit) / 2 - grid_current_max;
+  int32_t kept = ctx->start_limit > ctx->charger_max_current ? ctx->start_limit : ctx->charger_max_current;
+
+  if (grid_current_max <= ctx->config.upper_limit && kept > limit) {
+    limit = kept;
+  }
+  ctx->charger_max_current = limit;
+  ctx->start_limit = 0;
+  ctx->ramp_start = now;
+  ctx->ramping = true;
+}
+
+// Writes the power held during the last second, what leaves a window is the second its length ago
+static void demand_push(struct lb_demand* demand) {
+  for (int phase = 0; phase < 3; phase++) {
+    int16_t power = demand->hold[phase] < INT16_MIN ? INT16_MIN
+                    : demand->hold[phase] > INT16_MAX ? INT16_MAX
+                                                      : demand->hold[phase];
+    for (int w = 0; w < LB_WINDOW_LAST; w++) {
+      uint16_t leaving = (demand->head + LB_DEMAND_SECONDS - window_seconds[w]) % LB_DEMAND_SECONDS;
+      demand->sum[w][phase] += power - demand->power[leaving][phase];
+    }
+    demand->power[demand->head][phase] = power;
+  }
+  demand->head = (demand->head + 1) % LB_DEMAND_SECONDS;
+  if (demand->filled < LB_DEMAND_SECONDS) {
+    demand->filled++;
+  }
+}
+
+// Charger limit that keeps the quarter-hour average under the demand limit a minute from now. The part of the
+// quarter-hour that stays in the window is known, what is left of the budget is for the next minute. The limit moves
+// by half the difference between that and the power of the last measurement, as the vehicles follow it late.
+static void demand_update_cap(struct lb_context* ctx) {
+  struct lb_demand* demand = &ctx->demand;
+  int32_t window = window_seconds[LB_WINDOW_STAYING];
+  int32_t known = demand->filled < window ? demand->filled : window;
+  int64_t staying = 0;
+  int32_t power = 0;
+
+  for (int phase = 0; phase < 3; phase++) {
+    staying += demand->sum[LB_WINDOW_STAYING][phase];
+    power += demand->hold[phase];
+  }
+  if (known < window) {
+    // The seconds before the start are counted like the known ones
+    staying = known ? staying * window / known : (int64_t)power * window;
+  }
+
+  int64_t budget = ((int64_t)ctx->config.demand_limit * LB_DEMAND_SECONDS - staying) / (LB_DEMAND_SECONDS - window);
+  int64_t change = (budget - power) * 1000 / (NOMINAL_VOLTAGE * ctx->config.number_of_phases) / 2;
+  if (change > -DEMAND_DEADBAND && change < DEMAND_DEADBAND && demand->cap == ctx->charger_max_current) {
+    return;  // Not worth a charger limit write
+  }
+  int64_t cap = ctx->charger_max_current + change;
+  int32_t total_limit = get_total_charger_limit(ctx);
+  demand->cap = cap < 0 ? 0 : cap > total_limit ? total_limit : cap;
+}
+
+// The power measured holds until the next measurement, every second it held is written to the windows
+static void demand_commit(struct lb_context* ctx, uint32_t now) {
+  struct lb_demand* demand = &ctx->demand;
+
+  if (!demand->update) {
+    return;
+  }
+  demand->update = false;
+  if (!demand->valid) {
+    demand->valid = true;
+    demand->time = now;
+  }
+  for (uint16_t i = 0; now - demand->time >= 1000 && i < LB_DEMAND_SECONDS; i++) {
+    demand_push(demand);
+    demand->time += 1000;
+  }
+  if (now - demand->time >= 1000) {
+    demand->time = now;  // Gone for longer than the windows
+  }
+  memcpy(demand->hold, demand->next, sizeof(demand->hold));
+  if (ctx->config.demand_limit) {
+    demand_update_cap(ctx);
   }
 }
 
-static void lb_check(void) {
-  uint16_t grid_current_max = get_max_grid_current();
+static void lb_check(struct lb_context* ctx, uint32_t now) {
+  enum lb_state previous_state = ctx->state;
+  int32_t grid_current_max = get_max_grid_current(ctx);
+  int32_t total_limit = get_total_charger_limit(ctx);
+  int32_t target_limit = 0;
+  bool feedback;
+  bool grid_new = ctx->grid_update == LB_UPDATE_NEW;
 
-  if (wait_time > 0 && wait_time != WAIT_TIME_UNSET) {
-    wait_time--;
+  if (total_limit > ctx->charger_limit_override) {
+    total_limit = ctx->charger_limit_override;
+  }
+  ctx->checked = true;
+  ctx->check_time = now;
+  if (grid_new) {
+    ctx->grid_update = LB_UPDATE_VALID;
+    ctx->grid_time = now;
+  }
+  for (uint8_t i = 0; i < ctx->config.number_of_chargers; i++) {
+    if (ctx->chargers[i].feedback == LB_UPDATE_NEW) {
+      ctx->chargers[i].feedback = LB_UPDATE_VALID;
+      ctx->chargers[i].feedback_time = now;
+    }
+  }
+  feedback = get_target_limit(ctx, &target_limit, now);
+
+  if (ctx->grid_update != LB_UPDATE_VALID || now - ctx->grid_time >= ctx->config.fallback_limit_wait_time * 1000u) {
+    set_state(ctx, LB_STATE_FALLBACK, now);
+  } else if (grid_current_max > ctx->config.alarm_limit) {
+    set_state(ctx, LB_STATE_ALARM_LIMIT, now);
+  } else if (grid_current_max > ctx->config.upper_limit) {
+    set_state(ctx, LB_STATE_UPPER_LIMIT, now);
+  } else if (grid_current_max <= ctx->config.lower_limit && ctx->charger_max_current < total_limit) {
+    set_state(ctx, LB_STATE_LOWER_LIMIT, now);
+  } else {
+    set_state(ctx, LB_STATE_NORMAL, now);
   }
 
-  if (fallback_time > 0) {
-    fallback_time--;
+  if (previous_state == LB_STATE_FALLBACK && ctx->state != LB_STATE_FALLBACK) {
+    lb_warm_start(ctx, grid_current_max, feedback, target_limit, now);
   }
 
-  if (fallback_time == 0) {
-    set_state(LB_STATE_FALLBACK);
-  } else if (grid_current_max > config.alarm_limit) {
-    set_state(LB_STATE_ALARM_LIMIT);
-  } else if (grid_current_max > config.upper_limit) {
-    set_state(LB_STATE_UPPER_LIMIT);
-  } else if (grid_current_max <= config.lower_limit && charger_max_current < config.charger_limit) {
-    set_state(LB_STATE_LOWER_LIMIT);
+  // Only the alarm and fallback are left to the hysteresis controller
+  bool pi_control = ctx->config.controller == LB_CONTROLLER_PI && ctx->state != LB_STATE_ALARM_LIMIT &&
+                    ctx->state != LB_STATE_FALLBACK;
+  if (pi_control) {
+    // With feedback the limit that brings the grid current on target in one step is as far as it goes
+    if (grid_new) {
+      lb_pi_step(ctx, grid_current_max, feedback && target_limit < total_limit ? target_limit : total_limit, feedback,
+                 target_limit, now);
+    }
   } else {
-    set_state(LB_STATE_NORMAL);
+    ctx->pi.running = false;
   }
 
-  switch (state) {
+  switch (pi_control ? LB_STATE_NORMAL : ctx->state) {
     case LB_STATE_LOWER_LIMIT:  // Below the Lower limit: when the energy meter provides meter data to show sufficient
                                 // room to change configuration the charger will start increasing the power output (if
                                 // the charger is below its maximal rated current) by a certain amount.
 
-      if (wait_time == WAIT_TIME_UNSET) {
-        wait_time = config.lower_limit_wait_time;
-      } else if (wait_time == 0) {
-        wait_time = WAIT_TIME_UNSET;
-        charger_max_current += config.lower_limit_change_amount;
+      if (state_wait_done(ctx, ctx->config.lower_limit_wait_time, now)) {
+        // Not beyond the target, the room a charger leaves unused could be taken at once by another one
+        ctx->charger_max_current =
+            feedback ? target_limit : ctx->charger_max_current + ctx->config.lower_limit_change_amount;
       }
       break;
     case LB_STATE_NORMAL:  // area between the Upper limit and Lower limit. This is considered a safe area for the
@@ -102,11 +594,9 @@ static void lb_check(void) {
                                 // current available  (since it might be used by other electrical appliances). In this
                                 // region, the charger will decrease its power output by a certain amount.
 
-      if (wait_time == WAIT_TIME_UNSET) {
-        wait_time = config.upper_limit_wait_time;
-      } else if (wait_time == 0) {
-        wait_time = WAIT_TIME_UNSET;
-        charger_max_current -= config.upper_limit_change_amount;
+      if (state_wait_done(ctx, ctx->config.upper_limit_wait_time, now)) {
+        ctx->charger_max_current =
+            feedback ? target_limit : ctx->charger_max_current - ctx->config.upper_limit_change_amount;
       }
       break;
     case LB_STATE_ALARM_LIMIT:  // between the alarm limit and grid limit (Electrical capacity), an immediate response
@@ -114,100 +604,82 @@ static void lb_check(void) {
                                 // information to the charger that the current of a particular phase is in this area,
                                 // the charger will react by decreasing the power output by a considerable amount.
 
-      if (wait_time == WAIT_TIME_UNSET) {
-        wait_time = config.alarm_limit_wait_time;
-      } else if (wait_time == 0) {
-        charger_max_current -= config.alarm_limit_change_amount;
-        wait_time = WAIT_TIME_UNSET;
+      if (state_wait_done(ctx, ctx->config.alarm_limit_wait_time, now)) {
+        ctx->charger_max_current =
+            feedback ? target_limit : ctx->charger_max_current - ctx->config.alarm_limit_change_amount;
       }
       break;
 
     default:
     case LB_STATE_FALLBACK:  // grid current is not updated for some time. Set the charger to a current which will not
                              // cause and over current on the system
-      if (wait_time == WAIT_TIME_UNSET) {
-        wait_time = config.fallback_limit_wait_time;
-      } else if (wait_time == 0) {
-        wait_time = WAIT_TIME_UNSET;
-        charger_max_current = config.fallback_limit;
+      if (state_wait_done(ctx, ctx->config.fallback_limit_wait_time, now)) {
+        ctx->charger_max_current = ctx->config.fallback_limit;
       }
       break;
   }
 
-  if (charger_max_current < 0) {  // there is probably an over current somewhere else in the system
-    charger_max_current = 0;
-  } else if (charger_max_current > config.charger_limit) {
-    charger_max_current = config.charger_limit;
+  if (ctx->config.demand_limit && ctx->demand.valid && ctx->charger_max_current > ctx->demand.cap) {
+    ctx->charger_max_current = ctx->demand.cap;
   }
 
-  if (charger_max_current > charger_limit_override) {
-    charger_max_current = charger_limit_override;
+  if (ctx->charger_max_current < 0) {  // there is probably an over current somewhere else in the system
+    ctx->charger_max_current = 0;
+  } else if (ctx->charger_max_current > total_limit) {
+    ctx->charger_max_current = total_limit;
   }
 
-  if (lb_limit_charger_cb) {
-    lb_limit_charger_cb(charger_max_current);
+  if (ctx->state == LB_STATE_FALLBACK) {
+    ctx->ramping = false;
+  } else if (ctx->ramping && (grid_current_max > ctx->config.lower_limit || ctx->charger_max_current == total_limit)) {
+    ctx->ramping = false;
+    ctx->ramp_time = now - ctx->ramp_start;
   }
+
+  share_charger_limit(ctx);
 }
 
-void lb_task(uint32_t now) {
-  static uint32_t timeout = 0;
+void lb_commit_grid_current(struct lb_context* ctx, uint32_t now) {
+  demand_commit(ctx, now);
+  if (ctx->config.trigger == LB_TRIGGER_GRID_UPDATE) {
+    lb_check(ctx, now);
+  }
+}
 
-  if (timeout == 0 || now - timeout > CHECK_INTERVAL_MS) {
-    timeout = now;
-    lb_check();
+void lb_task(struct lb_context* ctx, uint32_t now) {
+  // With the grid update as trigger this only keeps the timing going when the updates stop
+  if (!ctx->checked || now - ctx->check_time > CHECK_INTERVAL_MS) {
+    lb_check(ctx, now);
   }
 }
 
-uint16_t lb_get_limit(void) {
-  return charger_max_current;
+uint32_t lb_get_limit(struct lb_context* ctx) {
+  return ctx->charger_max_current;
 };
 
-enum lb_state lb_get_state(void) {
-  return state;
+uint32_t lb_get_ramp_time(struct lb_context* ctx) {
+  return ctx->ramp_time;
+}
+
+uint16_t lb_get_charger_limit(struct lb_context* ctx, uint8_t charger) {
+  return charger < ctx->config.number_of_chargers ? ctx->chargers[charger].limit : 0;
+}
+
+enum lb_state lb_get_state(struct lb_context* ctx) {
+  return ctx->state;
 };
 
-#if 0
-//TODO Move to unit test
-static void limit_charger(uint16_t current) {
-  printf("Limit charger current to %d\n", current);
-}
-
-
-void test(void) {
-  uint16_t grid_limit = 25000;
-  struct lb_config my_config = {.charger_limit = 16000,
-                                .number_of_phases = 1,
-                                .alarm_limit = grid_limit - 1000,
-                                .alarm_limit_wait_time = 1,
-                                .alarm_limit_change_amount = grid_limit / 2,
-                                .upper_limit = grid_limit - 3000,
-                                .upper_limit_wait_time = 5,
-                                .upper_limit_change_amount = 1000,
-                                .lower_limit = grid_limit - 6000,
-                                .lower_limit_change_amount = 1000,
-                                .fallback_limit = 0,
-                                .fallback_limit_wait_time = 30};
-
-  lb_init(&my_config, &limit_charger);
-  //  lb_set_charger_limit(16000);
-
-  //  uint16_t grid = 23000;
-  //  uint16_t charger_load = 16000
-  //  lb_set_grid_current(LB_PHASE_1, 24500);
-  for (int i = 0; i < 3600; i++) {
-    //    printf("time: %d\n", i);
-    if (i < 300) {  // 5 min
-      lb_set_grid_current(LB_PHASE_1, 24500);
-    } else if (i < 300 * 2) {  // 10 min
-      lb_set_grid_current(LB_PHASE_1, 19000);
-    } else if (i < 300 * 3) {  // 15 min
-      lb_set_grid_current(LB_PHASE_1, 23000);
-    } else if (i < 300 * 4) {  // 20 min
-      lb_set_grid_current(LB_PHASE_1, 10000);
-    } else {
-      lb_set_grid_current(LB_PHASE_1, 19000);
-    }
-    lb_task(i);
-  }
-}
-#endif
\ No newline at end of file
+int32_t lb_get_average_power(struct lb_context* ctx, enum lb_window window, enum lb_phase phase) {
+  int32_t seconds = ctx->demand.filled < window_seconds[window] ? ctx->demand.filled : window_seconds[window];
+  int32_t sum = 0;
+
+  if (seconds == 0) {
+    return 0;
+  }
+  for (enum lb_phase i = LB_PHASE_1; i <= LB_PHASE_3; i++) {
+    if (phase == LB_PHASE_NONE || phase == i) {
+      sum += ctx->demand.sum[window][i];
+    }
+  }
+  return sum / seconds;
+}
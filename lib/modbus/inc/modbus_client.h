@@ -5,8 +5,12 @@
 
 #include "modbus_common.h"
 
-#define MB_CLIENT_REQUEST_TIMEOUT 1000
-#define MB_CLIENT_QUEUE_SIZE      10
+#define MB_CLIENT_REQUEST_TIMEOUT 1000  // Also the timeout for an address without round trip time yet
+#define MB_CLIENT_MIN_TIMEOUT     50
+#define MB_CLIENT_QUEUE_SIZE      16  // A poll, a limit write and its read back for several chargers
+#define MB_CLIENT_RETRIES         2
+#define MB_CLIENT_RETRY_BACKOFF   20  // Before the first retry, doubles for every next one
+#define MB_CLIENT_RTT_SLOTS       8   // Addresses with a round trip time estimate
 
 struct mb_client_cb {
   void (*read_coil_status)(uint8_t address, uint16_t start, uint16_t count, uint8_t* data);
@@ -17,7 +21,17 @@ struct mb_client_cb {
   void (*raw_rx)(uint8_t* data, size_t len);
 
   void (*tx)(uint8_t* data, size_t len);
+  void (*tx_start)(uint8_t* data, size_t len);  // Instead of tx: returns right away, signal the end with mb_client_tx_done
   uint32_t (*get_tick_ms)(void);
+  uint32_t (*get_tick_us)(void);  // Optional, needed for the silent interval detection
+};
+
+// Queued requests are sent by priority, in order of arrival within a priority
+enum mb_client_priority {
+  MB_CLIENT_PRIORITY_CONTROL,  // Writes
+  MB_CLIENT_PRIORITY_RAW,      // Pass-through
+  MB_CLIENT_PRIORITY_POLL,     // Reads
+  MB_CLIENT_PRIORITY_LAST
 };
 
 struct mb_client_buffer {
@@ -29,15 +43,62 @@ struct mb_client_buffer {
   uint16_t start;
   uint16_t count;
   bool raw;
-  bool ready;
+  uint8_t attempts;
+};
+
+struct mb_client_queue {
+  uint8_t buffers[MB_CLIENT_QUEUE_SIZE];  // Indexes in request_buffers
+  uint8_t head;
+  uint8_t count;
+};
+
+// Smoothed round trip time to the first byte of the response, scaled like in TCP (RFC 6298)
+struct mb_client_rtt {
+  uint8_t address;
+  uint16_t srtt;    // ms * 8, 0 without a measurement
+  uint16_t rttvar;  // ms * 4
+};
+
+// A request pushed out of the full queue, reported to the status callback from mb_client_task
+struct mb_client_dropped {
+  uint8_t address;
+  uint8_t function;
+};
+
+struct mb_client_stats {
+  uint32_t tx_blocking_us;  // Time spent in the transmit callback by the last request
+  uint32_t tx_blocking_max_us;
+  uint32_t queue_depth;
+  uint32_t queue_depth_max;
+  uint32_t queue_dropped;    // Requests refused or pushed out by a request with a higher priority
+  uint32_t queue_coalesced;  // Requests that replaced a queued one to the same address, function and start
+  uint32_t retries;
 };
 
 struct mb_client_context {
   struct mb_client_cb cb;
   struct mb_client_buffer* current_request;
-  struct mb_client_buffer request_queue[MB_CLIENT_QUEUE_SIZE];
+  struct mb_client_buffer request_buffers[MB_CLIENT_QUEUE_SIZE];
+  uint8_t free_buffers[MB_CLIENT_QUEUE_SIZE];
+  uint8_t free_count;
+  struct mb_client_queue queues[MB_CLIENT_PRIORITY_LAST];
+  struct mb_client_dropped dropped[MB_CLIENT_QUEUE_SIZE];
+  uint8_t dropped_count;
   struct mb_client_buffer response;
-  uint32_t request_timeout;
+  struct mb_rtu_rx rx;
+  struct ringbuf rx_ring;
+  uint8_t rx_buf[MB_RX_BUF_SIZE] __attribute__((aligned(MB_RX_BUF_SIZE)));  // Aligned for DMA ring mode
+  uint32_t request_time;  // When the request was sent
+  uint32_t response_time;  // When the first byte of the response was seen
+  uint32_t timeout;
+  uint32_t retry_time;  // When the last attempt failed
+  bool waiting;  // For a response to the current request
+  bool retry_wait;  // For the backoff before the current request is sent again
+  volatile bool tx_busy;  // Cleared by mb_client_tx_done
+  bool tx_wait;
+  struct mb_client_rtt rtt[MB_CLIENT_RTT_SLOTS];
+  uint8_t rtt_next;
+  struct mb_client_stats stats;
 };
 
 int mb_client_init(struct mb_client_context* ctx, struct mb_client_cb* cb);
@@ -54,5 +115,8 @@ int mb_client_write_multiple_registers(struct mb_client_context* ctx, uint8_t ad
 
 int mb_client_send_raw(struct mb_client_context* ctx, uint8_t* data, size_t len);
 
+int mb_client_set_baudrate(struct mb_client_context* ctx, uint32_t baudrate);
 void mb_client_rx(struct mb_client_context* ctx, uint8_t b);
+void mb_client_tx_done(struct mb_client_context* ctx);
 void mb_client_task(struct mb_client_context* ctx);
+uint32_t mb_client_get_timeout(struct mb_client_context* ctx, uint8_t address);
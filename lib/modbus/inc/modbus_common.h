@@ -4,11 +4,15 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "ringbuf.h"
+
 #define MB_MAX_RTU_FRAME_SIZE 256
 #define MB_MAX_REGISTERS      123
+#define MB_RX_BUF_SIZE        256  // Power of two
 
 enum mb_state {
   MB_DATA_READY,
@@ -16,6 +20,7 @@ enum mb_state {
   MB_ERROR,
   MB_INVALID_SERVER_ADDRESS,
   MB_INVALID_FUNCTION,
+  MB_INVALID_CRC,
 };
 
 enum mb_result {
@@ -36,6 +41,7 @@ enum mb_result {
   MB_ERROR_TIMEOUT = 0xF0,
   MB_ERROR_INVALID_CRC,
   MB_ERROR_UNEXPECTED_RESPONSE,
+  MB_ERROR_DROPPED,  // Pushed out of the full queue by a request with a higher priority
 };
 
 enum mb_function {
@@ -55,4 +61,26 @@ struct __attribute((packed)) mb_rtu_frame {
   uint8_t data[MB_MAX_RTU_FRAME_SIZE - 2];
 };
 
-uint16_t mb_calc_crc16(const uint8_t* buf, uint8_t len);
+// Byte driven RTU frame receiver. The CRC is updated with every byte and the frame length is derived from the function
+// code, so the state only changes from MB_DATA_INCOMPLETE once, when the frame is complete or invalid.
+// With a baud rate set the silent intervals delimit the frames as well: t3.5 of silence drops an incomplete frame and
+// t1.5 of silence within a frame invalidates it. After an invalid frame all bytes are discarded until t3.5 of silence,
+// so a stray byte costs one silent interval instead of a request timeout.
+struct mb_rtu_rx {
+  enum mb_state state;
+  size_t length;  // Expected frame length, 0 while still unknown
+  uint16_t crc;
+  bool request;  // Receiving requests (server) instead of responses (client)
+  bool discard;  // Drop bytes until the next t3.5 silent interval
+  uint32_t char_us;  // Time of one 11 bit character, 0 without silent interval detection
+  uint32_t t15_us;
+  uint32_t t35_us;
+  uint32_t last_us;  // When the last byte was seen
+};
+
+uint16_t mb_calc_crc16(const uint8_t* buf, size_t len);
+void mb_rtu_rx_init(struct mb_rtu_rx* rx, bool request);
+void mb_rtu_rx_set_baudrate(struct mb_rtu_rx* rx, uint32_t baudrate);
+void mb_rtu_rx_reset(struct mb_rtu_rx* rx);
+enum mb_state mb_rtu_rx(struct mb_rtu_rx* rx, uint8_t* data, size_t* pos, uint8_t b);
+enum mb_state mb_rtu_receive(struct mb_rtu_rx* rx, struct ringbuf* ring, uint8_t* data, size_t* pos, uint32_t now_us);
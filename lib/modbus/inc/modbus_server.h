@@ -21,6 +21,7 @@ struct mb_server_cb {
 
   void (*tx)(uint8_t* data, size_t len);
   uint32_t (*get_tick_ms)(void);
+  uint32_t (*get_tick_us)(void);  // Optional, needed for the silent interval detection
 };
 
 struct mb_server_buffer {
@@ -36,10 +37,14 @@ struct mb_server_context {
   struct mb_server_cb cb;
   struct mb_server_buffer request;
   struct mb_server_buffer response;
+  struct mb_rtu_rx rx;
+  struct ringbuf rx_ring;
+  uint8_t rx_buf[MB_RX_BUF_SIZE] __attribute__((aligned(MB_RX_BUF_SIZE)));  // Aligned for DMA ring mode
   uint32_t timeout;
 };
 
 int mb_server_init(struct mb_server_context* ctx, uint8_t address, struct mb_server_cb* cb);
+int mb_server_set_baudrate(struct mb_server_context* ctx, uint32_t baudrate);
 void mb_server_rx(struct mb_server_context* ctx, uint8_t b);
 void mb_server_add_response(struct mb_server_context* ctx, uint16_t value);
 void mb_server_task(struct mb_server_context* ctx);
@@ -1,25 +1,158 @@
 //  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
 //  SPDX-License-Identifier: MIT
 
+#include "crc16.h"
 #include "modbus_common.h"
 
-#define MODBUS_POLY 0xA001
 #define MODBUS_SEED 0xFFFF
 
-uint16_t mb_calc_crc16(const uint8_t* src, uint8_t len) {
-  uint16_t crc = MODBUS_SEED;
-  size_t i, j;
+#define MB_RTU_CHAR_BITS     11  // Start, 8 data, parity or second stop bit and stop bit
+#define MB_RTU_FIXED_BAUD    19200  // Above this the silent intervals are fixed
+#define MB_RTU_FIXED_T15_US  750
+#define MB_RTU_FIXED_T35_US  1750
 
-  for (i = 0; i < len; i++) {
-    crc ^= (uint16_t)src[i];
+uint16_t mb_calc_crc16(const uint8_t* src, size_t len) {
+  return __builtin_bswap16(crc16_update(MODBUS_SEED, src, len));
+}
 
-    for (j = 0; j < 8; j++) {
-      if (crc & 0x0001UL) {
-        crc = (crc >> 1U) ^ MODBUS_POLY;
-      } else {
-        crc = crc >> 1U;
+void mb_rtu_rx_init(struct mb_rtu_rx* rx, bool request) {
+  rx->request = request;
+  rx->discard = false;
+  rx->char_us = 0;
+  mb_rtu_rx_reset(rx);
+}
+
+void mb_rtu_rx_set_baudrate(struct mb_rtu_rx* rx, uint32_t baudrate) {
+  if (baudrate == 0) {
+    rx->char_us = 0;
+    return;
+  }
+  rx->char_us = (MB_RTU_CHAR_BITS * 1000000 + baudrate - 1) / baudrate;
+  if (baudrate > MB_RTU_FIXED_BAUD) {
+    rx->t15_us = MB_RTU_FIXED_T15_US;
+    rx->t35_us = MB_RTU_FIXED_T35_US;
+  } else {
+    rx->t15_us = rx->char_us * 3 / 2;
+    rx->t35_us = rx->char_us * 7 / 2;
+  }
+}
+
+void mb_rtu_rx_reset(struct mb_rtu_rx* rx) {
+  rx->state = MB_DATA_INCOMPLETE;
+  rx->length = 0;
+  rx->crc = MODBUS_SEED;
+}
+
+// Returns the frame length once enough of the frame is received to know it, 0 if more bytes are needed and -1 if the
+// function is not supported.
+static int mb_rtu_frame_length(const struct mb_rtu_rx* rx, const uint8_t* data, size_t pos) {
+  uint8_t function = data[1];
+
+  if (function & 0x80) {
+    return 5;
+  }
+
+  switch (function) {
+    case MB_READ_COIL_STATUS:
+    case MB_READ_INPUT_STATUS:
+    case MB_READ_HOLDING_REGISTERS:
+    case MB_READ_INPUT_REGISTERS:
+      if (rx->request) {
+        return 8;
+      }
+      return pos > 2 ? data[2] + 5 : 0;
+    case MB_WRITE_SINGLE_COIL:
+    case MB_WRITE_SINGLE_REGISTER:
+      return 8;
+    case MB_WRITE_MULTIPLE_COILS:
+    case MB_WRITE_MULTIPLE_REGISTERS:
+      if (!rx->request) {
+        return 8;
+      }
+      return pos > 6 ? data[6] + 9 : 0;
+    default:
+      return -1;
+  }
+}
+
+enum mb_state mb_rtu_rx(struct mb_rtu_rx* rx, uint8_t* data, size_t* pos, uint8_t b) {
+  if (rx->state != MB_DATA_INCOMPLETE) {
+    return rx->state;  // Wait until the current frame is handled
+  }
+
+  data[(*pos)++] = b;
+  rx->crc = crc16_update_byte(rx->crc, b);
+
+  if (rx->length == 0 && *pos >= 2) {
+    int length = mb_rtu_frame_length(rx, data, *pos);
+    if (length < 0) {
+      rx->state = MB_INVALID_FUNCTION;
+      return rx->state;
+    }
+    if (length > MB_MAX_RTU_FRAME_SIZE) {
+      rx->state = MB_ERROR;
+      return rx->state;
+    }
+    rx->length = length;
+  }
+
+  if (rx->length && *pos == rx->length) {
+    // Including the CRC itself, the CRC of a valid frame is zero
+    rx->state = rx->crc ? MB_INVALID_CRC : MB_DATA_READY;
+  }
+  if (rx->state != MB_DATA_INCOMPLETE && rx->state != MB_DATA_READY && rx->char_us) {
+    rx->discard = true;  // The length is not to be trusted, so wait for the end of the frame
+  }
+  return rx->state;
+}
+
+// Bytes are only seen when the task runs, so only the silence since the last byte was seen is certain, minus a
+// character that might be on the line right now. Gaps before bytes that arrived between two runs of the task can't be
+// measured, so the task must run more often than t1.5 for the detection to work.
+static void mb_rtu_silence(struct mb_rtu_rx* rx, size_t* pos, uint32_t now_us) {
+  uint32_t silence = now_us - rx->last_us;
+
+  silence = silence > rx->char_us ? silence - rx->char_us : 0;
+  if (silence >= rx->t35_us) {
+    rx->discard = false;
+  } else if (silence < rx->t15_us || *pos == 0) {
+    return;
+  } else {
+    rx->discard = true;  // Gap within the frame
+  }
+
+  // Drop what was received of the frame so far
+  *pos = 0;
+  mb_rtu_rx_reset(rx);
+}
+
+// Moves bytes from the ring into the frame until it is complete. Returns the state of the frame.
+enum mb_state mb_rtu_receive(struct mb_rtu_rx* rx, struct ringbuf* ring, uint8_t* data, size_t* pos, uint32_t now_us) {
+  const uint8_t* span;
+  size_t len;
+
+  if (rx->state != MB_DATA_INCOMPLETE) {
+    return rx->state;  // Wait until the current frame is handled
+  }
+
+  if (rx->char_us) {
+    if (ringbuf_count(ring) == 0) {
+      mb_rtu_silence(rx, pos, now_us);
+      return rx->state;
+    }
+    rx->last_us = now_us;
+  }
+
+  // Stop at the end of a frame, the rest is handled after it
+  while (rx->state == MB_DATA_INCOMPLETE && (len = ringbuf_read_span(ring, &span)) > 0) {
+    size_t i = 0;
+    if (rx->discard) {
+      i = len;
+    } else {
+      while (i < len && mb_rtu_rx(rx, data, pos, span[i++]) == MB_DATA_INCOMPLETE) {
       }
     }
+    ringbuf_commit(ring, i);
   }
-  return __builtin_bswap16(crc);
-}
\ No newline at end of file
+  return rx->state;
+}
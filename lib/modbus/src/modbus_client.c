@@ -9,78 +9,163 @@
 int mb_client_init(struct mb_client_context* ctx, struct mb_client_cb* cb) {
   memset(ctx, 0, sizeof(struct mb_client_context));
   ctx->cb = *cb;
+  mb_rtu_rx_init(&ctx->rx, false);
+  ringbuf_init(&ctx->rx_ring, ctx->rx_buf, sizeof(ctx->rx_buf));
+  for (int i = 0; i < MB_CLIENT_QUEUE_SIZE; i++) {
+    ctx->free_buffers[ctx->free_count++] = i;
+  }
 
-  if (ctx->cb.tx == NULL || ctx->cb.get_tick_ms == NULL) {
+  if ((ctx->cb.tx == NULL && ctx->cb.tx_start == NULL) || ctx->cb.get_tick_ms == NULL) {
     return -1;
   }
 
   return 0;
 }
 
+static void mb_queue_release(struct mb_client_context* ctx, struct mb_client_buffer* request) {
+  ctx->free_buffers[ctx->free_count++] = request - ctx->request_buffers;
+  ctx->stats.queue_depth--;
+}
+
 static inline void mb_reset(struct mb_client_context* ctx) {
   ctx->response.pos = 0;
-  ctx->request_timeout = 0;
+  mb_rtu_rx_reset(&ctx->rx);
+  ctx->waiting = false;
+  ctx->retry_wait = false;
+  ctx->tx_wait = false;
+  ctx->tx_busy = false;
   if (ctx->current_request) {
-    ctx->current_request->data[0] = 0;
-    ctx->current_request->ready = false;
+    mb_queue_release(ctx, ctx->current_request);
     ctx->current_request = NULL;
   }
 }
 
-void mb_client_rx(struct mb_client_context* ctx, uint8_t b) {
-  if (ctx->response.pos < (sizeof(ctx->response.data) - 1)) {
-    ctx->response.data[ctx->response.pos++] = b;
+// Enables the t1.5/t3.5 silent interval detection, this needs the get_tick_us callback
+int mb_client_set_baudrate(struct mb_client_context* ctx, uint32_t baudrate) {
+  if (ctx->cb.get_tick_us == NULL) {
+    return -1;
   }
+  mb_rtu_rx_set_baudrate(&ctx->rx, baudrate);
+  return 0;
 }
 
-static enum mb_state mb_check_buf(struct mb_client_context* ctx) {
-  if (ctx->response.pos > 4) {
-    if (ctx->response.frame.address != ctx->current_request->frame.address) {
-      return MB_INVALID_SERVER_ADDRESS;
-    }
-    if (ctx->response.frame.function & 0x80) {
-      if (ctx->response.pos == 5) {
-        return MB_ERROR;
-      }
-    }
-    switch (ctx->response.frame.function) {
-      case MB_READ_COIL_STATUS:
-      case MB_READ_INPUT_STATUS:
-      case MB_READ_HOLDING_REGISTERS:
-      case MB_READ_INPUT_REGISTERS:
-        if (ctx->response.pos == ctx->response.frame.data[0] + 5) {
-          return MB_DATA_READY;
-        }
-        break;
-      case MB_WRITE_SINGLE_COIL:
-      case MB_WRITE_SINGLE_REGISTER:
-      case MB_WRITE_MULTIPLE_COILS:
-      case MB_WRITE_MULTIPLE_REGISTERS:
-        if (ctx->response.pos == 8) {
-          return MB_DATA_READY;
-        }
-        break;
-      default:
-        return MB_INVALID_FUNCTION;
+void mb_client_rx(struct mb_client_context* ctx, uint8_t b) {  // Interrupt
+  ringbuf_put(&ctx->rx_ring, b);
+}
+
+void mb_client_tx_done(struct mb_client_context* ctx) {  // Interrupt
+  ctx->tx_busy = false;
+}
+
+static struct mb_client_rtt* mb_rtt_find(struct mb_client_context* ctx, uint8_t address) {
+  for (int i = 0; i < MB_CLIENT_RTT_SLOTS; i++) {
+    if (ctx->rtt[i].address == address) {
+      return &ctx->rtt[i];
     }
   }
-  return MB_DATA_INCOMPLETE;
+  return NULL;
 }
 
-static void mb_rx_rtu(struct mb_client_context* ctx) {
-  uint16_t registers[MB_MAX_REGISTERS];
+static void mb_rtt_update(struct mb_client_context* ctx, uint8_t address, uint32_t rtt) {
+  struct mb_client_rtt* entry = mb_rtt_find(ctx, address);
 
-  if (ctx->current_request == NULL) {
-    return;
+  if (entry == NULL) {
+    entry = &ctx->rtt[ctx->rtt_next];
+    ctx->rtt_next = (ctx->rtt_next + 1) % MB_CLIENT_RTT_SLOTS;
+    entry->address = address;
+    entry->srtt = 0;
   }
 
-  if (mb_calc_crc16(ctx->response.data, ctx->response.pos)) {
-    if (ctx->cb.status) {
-      ctx->cb.status(ctx->current_request->frame.address, ctx->current_request->frame.function, MB_ERROR_INVALID_CRC);
+  rtt = rtt ? rtt : 1;
+  if (entry->srtt == 0) {
+    entry->srtt = rtt << 3;
+    entry->rttvar = rtt << 1;
+  } else {
+    int32_t err = (int32_t)rtt - (entry->srtt >> 3);
+    entry->srtt += err;
+    entry->rttvar += abs(err) - (entry->rttvar >> 2);
+  }
+}
+
+uint32_t mb_client_get_timeout(struct mb_client_context* ctx, uint8_t address) {
+  struct mb_client_rtt* entry = mb_rtt_find(ctx, address);
+
+  if (entry == NULL || entry->srtt == 0) {
+    return MB_CLIENT_REQUEST_TIMEOUT;
+  }
+  uint32_t timeout = (entry->srtt >> 3) + entry->rttvar;
+  if (timeout < MB_CLIENT_MIN_TIMEOUT) {
+    return MB_CLIENT_MIN_TIMEOUT;
+  }
+  return timeout < MB_CLIENT_REQUEST_TIMEOUT ? timeout : MB_CLIENT_REQUEST_TIMEOUT;
+}
+
+static void mb_client_tx(struct mb_client_context* ctx, struct mb_client_buffer* request) {
+  uint32_t start_us = ctx->cb.get_tick_us ? ctx->cb.get_tick_us() : 0;
+
+  ctx->response.pos = 0;
+  mb_rtu_rx_reset(&ctx->rx);
+
+  // Every retry doubles the timeout
+  ctx->timeout = mb_client_get_timeout(ctx, request->frame.address) << request->attempts;
+  if (ctx->timeout > MB_CLIENT_REQUEST_TIMEOUT) {
+    ctx->timeout = MB_CLIENT_REQUEST_TIMEOUT;
+  }
+  request->attempts++;
+
+  if (ctx->cb.tx_start) {
+    ctx->tx_busy = true;
+    ctx->tx_wait = true;
+    ctx->cb.tx_start(request->data, request->pos);
+  } else {
+    ctx->cb.tx(request->data, request->pos);
+  }
+  ctx->request_time = ctx->cb.get_tick_ms();
+  ctx->waiting = true;
+
+  if (ctx->cb.get_tick_us) {
+    ctx->stats.tx_blocking_us = ctx->cb.get_tick_us() - start_us;
+    if (ctx->stats.tx_blocking_us > ctx->stats.tx_blocking_max_us) {
+      ctx->stats.tx_blocking_max_us = ctx->stats.tx_blocking_us;
     }
+  }
+}
+
+// Requests are idempotent, except for pass-through ones that may be anything and are retried by their sender. A
+// timeout is only retried for an address that responded before, a dead device should not hold up the bus any longer.
+static void mb_client_fail(struct mb_client_context* ctx, uint8_t error) {
+  struct mb_client_buffer* request = ctx->current_request;
+
+  if (!request->raw && request->attempts <= MB_CLIENT_RETRIES &&
+      (error != MB_ERROR_TIMEOUT || mb_rtt_find(ctx, request->frame.address))) {
+    ctx->stats.retries++;
+    ctx->response.pos = 0;
+    mb_rtu_rx_reset(&ctx->rx);
+    ctx->waiting = false;
+    ctx->retry_wait = true;
+    ctx->retry_time = ctx->cb.get_tick_ms();
     return;
   }
 
+  if (ctx->cb.status) {
+    ctx->cb.status(request->frame.address, request->frame.function, error);
+  }
+  mb_reset(ctx);
+}
+
+static void mb_client_receive(struct mb_client_context* ctx, uint32_t now) {
+  uint32_t now_us = ctx->cb.get_tick_us ? ctx->cb.get_tick_us() : 0;
+  size_t pos = ctx->response.pos;
+
+  mb_rtu_receive(&ctx->rx, &ctx->rx_ring, ctx->response.data, &ctx->response.pos, now_us);
+  if (pos == 0 && ctx->response.pos) {
+    ctx->response_time = now;
+  }
+}
+
+static void mb_rx_rtu(struct mb_client_context* ctx) {
+  uint16_t registers[MB_MAX_REGISTERS];
+
   if (ctx->current_request->raw) {
     if (ctx->cb.raw_rx) {
       ctx->cb.raw_rx(ctx->response.data, ctx->response.pos);
@@ -146,40 +231,93 @@ static void mb_rx_rtu(struct mb_client_context* ctx) {
   }
 }
 
+// Not from the mb_client_* call that pushed the request out, its caller may be in the middle of the status callback
+static void mb_client_report_dropped(struct mb_client_context* ctx) {
+  for (int i = 0; i < ctx->dropped_count; i++) {  // The callback may push out more
+    if (ctx->cb.status) {
+      ctx->cb.status(ctx->dropped[i].address, ctx->dropped[i].function, MB_ERROR_DROPPED);
+    }
+  }
+  ctx->dropped_count = 0;
+}
+
 void mb_client_task(struct mb_client_context* ctx) {
-  // Check the receiving buffer
-  switch (mb_check_buf(ctx)) {
-    case MB_INVALID_FUNCTION:
-      mb_reset(ctx);
+  uint32_t now = ctx->cb.get_tick_ms();
+
+  mb_client_report_dropped(ctx);
+
+  if (ctx->tx_wait) {
+    if (ctx->tx_busy) {
+      if (now - ctx->request_time > MB_CLIENT_REQUEST_TIMEOUT) {
+        if (ctx->cb.status) {
+          ctx->cb.status(ctx->current_request->frame.address, ctx->current_request->frame.function,
+                         MB_ERROR_TIMEOUT);
+        }
+        mb_reset(ctx);
+      }
+      return;
+    }
+    // The response timeout starts once the request is on the line
+    ctx->tx_wait = false;
+    ctx->request_time = now;
+  }
+
+  mb_client_receive(ctx, now);
+
+  // Check the receiving state, this is only set once a frame is complete
+  switch (ctx->rx.state) {
+    case MB_DATA_INCOMPLETE:
       break;
-    case MB_ERROR:
     case MB_DATA_READY:
+      if (ctx->current_request == NULL || ctx->response.frame.address != ctx->current_request->frame.address) {
+        // Not the response we are waiting for
+        ctx->response.pos = 0;
+        mb_rtu_rx_reset(&ctx->rx);
+        break;
+      }
+      if (ctx->current_request->attempts == 1 && ctx->waiting) {
+        // Only a response to a request that was sent once tells the round trip time (Karn)
+        mb_rtt_update(ctx, ctx->current_request->frame.address, ctx->response_time - ctx->request_time);
+      }
       mb_rx_rtu(ctx);
       mb_reset(ctx);
+      break;
+    case MB_INVALID_CRC:
+      if (ctx->current_request) {
+        mb_client_fail(ctx, MB_ERROR_INVALID_CRC);
+        break;
+      }
+      mb_reset(ctx);
+      break;
     default:
-    case MB_INVALID_SERVER_ADDRESS:
-    case MB_DATA_INCOMPLETE:
+      mb_reset(ctx);
       break;
   }
 
-  // Check if we have a timeout
-  if (ctx->request_timeout > 0 && ctx->cb.get_tick_ms() - ctx->request_timeout > MB_CLIENT_REQUEST_TIMEOUT) {
-    if (ctx->cb.status) {
-      ctx->cb.status(ctx->current_request->frame.address, ctx->current_request->frame.function, MB_ERROR_TIMEOUT);
-    }
-    mb_reset(ctx);
+  // Only wait for the whole timeout if nothing arrives, a response that started is ended by its length or silence
+  uint32_t timeout = ctx->response.pos ? MB_CLIENT_REQUEST_TIMEOUT : ctx->timeout;
+  if (ctx->waiting && now - ctx->request_time > timeout) {
+    mb_client_fail(ctx, MB_ERROR_TIMEOUT);
+  }
+
+  if (ctx->retry_wait &&
+      now - ctx->retry_time >= (uint32_t)MB_CLIENT_RETRY_BACKOFF << (ctx->current_request->attempts - 1)) {
+    ctx->retry_wait = false;
+    mb_client_tx(ctx, ctx->current_request);
+    return;
   }
 
   if (ctx->current_request == NULL) {
-    // Check if there is a new request available
-    for (int i = 0; i < MB_CLIENT_QUEUE_SIZE; i++) {
-      struct mb_client_buffer* request = &ctx->request_queue[i];
-      if (request->data[0] && request->ready) {
-        request->ready = false;
+    // Send the oldest request with the highest priority
+    for (int i = 0; i < MB_CLIENT_PRIORITY_LAST; i++) {
+      struct mb_client_queue* queue = &ctx->queues[i];
+      if (queue->count) {
+        struct mb_client_buffer* request = &ctx->request_buffers[queue->buffers[queue->head]];
+        queue->head = (queue->head + 1) % MB_CLIENT_QUEUE_SIZE;
+        queue->count--;
         ctx->current_request = request;
-        ctx->cb.tx(request->data, request->pos);
-        ctx->response.pos = 0;
-        ctx->request_timeout = ctx->cb.get_tick_ms();
+        request->attempts = 0;
+        mb_client_tx(ctx, request);
         return;
       }
     }
@@ -191,21 +329,81 @@ static void mb_request_add(struct mb_client_buffer* request, uint16_t value) {
   request->data[request->pos++] = value & 0xFF;
 }
 
-static struct mb_client_buffer* get_request_buffer(struct mb_client_context* ctx) {
-  for (int i = 0; i < MB_CLIENT_QUEUE_SIZE; i++) {
-    if (!ctx->request_queue[i].data[0]) {
-      return &ctx->request_queue[i];
+static inline uint8_t* mb_queue_at(struct mb_client_queue* queue, int i) {
+  return &queue->buffers[(queue->head + i) % MB_CLIENT_QUEUE_SIZE];
+}
+
+// An owner only needs to hear once that its requests with a function were pushed out
+static void mb_queue_dropped(struct mb_client_context* ctx, uint8_t address, uint8_t function) {
+  for (int i = 0; i < ctx->dropped_count; i++) {
+    if (ctx->dropped[i].address == address && ctx->dropped[i].function == function) {
+      return;
+    }
+  }
+  if (ctx->dropped_count < MB_CLIENT_QUEUE_SIZE) {
+    ctx->dropped[ctx->dropped_count++] = (struct mb_client_dropped){address, function};
+  }
+}
+
+// A new request to the same address, function and start replaces the queued one, so only the newest value is sent
+static struct mb_client_buffer* mb_queue_find(struct mb_client_context* ctx, enum mb_client_priority priority,
+                                              uint8_t address, uint8_t function, uint16_t start) {
+  struct mb_client_queue* queue = &ctx->queues[priority];
+
+  for (int i = 0; i < queue->count; i++) {
+    struct mb_client_buffer* request = &ctx->request_buffers[*mb_queue_at(queue, i)];
+    if (request->frame.address == address && request->frame.function == function && request->start == start) {
+      ctx->stats.queue_coalesced++;
+      return request;
     }
   }
   return NULL;
 }
 
+static struct mb_client_buffer* mb_queue_push(struct mb_client_context* ctx, enum mb_client_priority priority) {
+  if (ctx->free_count == 0) {
+    // Push out the newest request with the lowest priority below this one
+    int victim = MB_CLIENT_PRIORITY_LAST - 1;
+    while (victim > (int)priority && ctx->queues[victim].count == 0) {
+      victim--;
+    }
+    ctx->stats.queue_dropped++;
+    if (victim <= (int)priority) {
+      return NULL;
+    }
+    struct mb_client_queue* queue = &ctx->queues[victim];
+    struct mb_client_buffer* dropped = &ctx->request_buffers[*mb_queue_at(queue, --queue->count)];
+    // Its owner may be waiting for it, like a charger for the write of its limit
+    mb_queue_dropped(ctx, dropped->frame.address, dropped->frame.function);
+    ctx->free_buffers[ctx->free_count++] = dropped - ctx->request_buffers;
+    ctx->stats.queue_depth--;
+  }
+
+  struct mb_client_queue* queue = &ctx->queues[priority];
+  uint8_t index = ctx->free_buffers[--ctx->free_count];
+  *mb_queue_at(queue, queue->count++) = index;
+
+  if (++ctx->stats.queue_depth > ctx->stats.queue_depth_max) {
+    ctx->stats.queue_depth_max = ctx->stats.queue_depth;
+  }
+  return &ctx->request_buffers[index];
+}
+
+static struct mb_client_buffer* get_request_buffer(struct mb_client_context* ctx, uint8_t address, uint8_t function,
+                                                   uint16_t start) {
+  enum mb_client_priority priority =
+      function >= MB_WRITE_SINGLE_COIL ? MB_CLIENT_PRIORITY_CONTROL : MB_CLIENT_PRIORITY_POLL;
+  struct mb_client_buffer* request = mb_queue_find(ctx, priority, address, function, start);
+
+  return request ? request : mb_queue_push(ctx, priority);
+}
+
 int mb_client_read_write(struct mb_client_context* ctx, uint8_t address, uint8_t fn, uint16_t start, uint16_t count) {
   if (ctx == NULL || address == 0) {
     return -1;
   }
 
-  struct mb_client_buffer* request = get_request_buffer(ctx);
+  struct mb_client_buffer* request = get_request_buffer(ctx, address, fn, start);
   if (request == NULL) {
     return -1;
   }
@@ -214,21 +412,20 @@ int mb_client_read_write(struct mb_client_context* ctx, uint8_t address, uint8_t
   request->frame.function = fn;
   request->start = start;
   request->count = count;
-  request->pos = sizeof(struct mb_rtu_frame);
+  request->pos = offsetof(struct mb_client_buffer, frame.data);
   mb_request_add(request, start);
   mb_request_add(request, count);
   mb_request_add(request, mb_calc_crc16(request->data, request->pos));
   request->raw = false;
-  request->ready = true;
   return 0;
 }
 
 int mb_client_send_raw(struct mb_client_context* ctx, uint8_t* data, size_t len) {
-  if (ctx == NULL || data == NULL || len == 0) {
+  if (ctx == NULL || data == NULL || len == 0 || len > MB_MAX_RTU_FRAME_SIZE) {
     return -1;
   }
 
-  struct mb_client_buffer* request = get_request_buffer(ctx);
+  struct mb_client_buffer* request = mb_queue_push(ctx, MB_CLIENT_PRIORITY_RAW);
   if (request == NULL) {
     return -1;
   }
@@ -236,7 +433,6 @@ int mb_client_send_raw(struct mb_client_context* ctx, uint8_t* data, size_t len)
   memcpy(request->data, data, len);
   request->raw = true;
   request->pos = len;
-  request->ready = true;
   return 0;
 }
 
@@ -276,7 +472,7 @@ int mb_client_write_multiple_registers(struct mb_client_context* ctx, uint8_t ad
     return -1;
   }
 
-  struct mb_client_buffer* request = get_request_buffer(ctx);
+  struct mb_client_buffer* request = get_request_buffer(ctx, address, MB_WRITE_MULTIPLE_REGISTERS, start);
   if (request == NULL) {
     return -1;
   }
@@ -296,6 +492,5 @@ int mb_client_write_multiple_registers(struct mb_client_context* ctx, uint8_t ad
 
   mb_request_add(request, mb_calc_crc16(request->data, request->pos));
   request->raw = false;
-  request->ready = true;
   return 0;
 }
@@ -5,39 +5,9 @@
 
 #include <string.h>
 
-static enum mb_state mb_check_buf(struct mb_server_context* ctx) {
-  if (ctx->request.pos > 4) {
-    if (ctx->request.frame.function & 0x80) {
-      if (ctx->request.pos == 5) {
-        return MB_ERROR;
-      }
-    }
-    switch (ctx->request.frame.function) {
-      case MB_READ_COIL_STATUS:
-      case MB_READ_INPUT_STATUS:
-      case MB_READ_HOLDING_REGISTERS:
-      case MB_READ_INPUT_REGISTERS:
-      case MB_WRITE_SINGLE_COIL:
-      case MB_WRITE_SINGLE_REGISTER:
-        if (ctx->request.pos == 8) {
-          return MB_DATA_READY;
-        }
-        break;
-      case MB_WRITE_MULTIPLE_COILS:
-      case MB_WRITE_MULTIPLE_REGISTERS:
-        if (ctx->request.pos == ctx->request.data[6] + 9) {
-          return MB_DATA_READY;
-        }
-        break;
-      default:
-        return MB_INVALID_FUNCTION;
-    }
-  }
-  return MB_DATA_INCOMPLETE;
-}
-
 static inline void mb_reset(struct mb_server_context* ctx) {
   ctx->request.pos = 0;
+  mb_rtu_rx_reset(&ctx->rx);
 }
 
 static void mb_response_tx(struct mb_server_context* ctx) {
@@ -70,12 +40,6 @@ static void mb_rx_rtu(struct mb_server_context* ctx) {
   uint16_t registers[MB_MAX_REGISTERS];
   uint8_t res;
 
-  // Check CRC
-  if (mb_calc_crc16(ctx->request.data, ctx->request.pos)) {
-    // Invalid CRC
-    return;
-  }
-
   if (ctx->request.frame.address != ctx->address || ctx->address == 0) {
     // It's a valid frame, but not for us. Maybe someone else can handle it
     if (ctx->cb.raw_rx) {
@@ -164,6 +128,8 @@ int mb_server_init(struct mb_server_context* ctx, uint8_t address, struct mb_ser
   memset(ctx, 0, sizeof(struct mb_server_context));
   ctx->address = address;
   ctx->cb = *cb;
+  mb_rtu_rx_init(&ctx->rx, true);
+  ringbuf_init(&ctx->rx_ring, ctx->rx_buf, sizeof(ctx->rx_buf));
 
   if (ctx->cb.tx == NULL || ctx->cb.get_tick_ms == NULL) {
     return -1;
@@ -172,30 +138,58 @@ int mb_server_init(struct mb_server_context* ctx, uint8_t address, struct mb_ser
   return 0;
 }
 
-void mb_server_rx(struct mb_server_context* ctx, uint8_t b) {
-  if (ctx->cb.get_tick_ms() - ctx->timeout > MB_SERVER_RECEIVE_TIMEOUT) {
-    mb_reset(ctx);
+// Enables the t1.5/t3.5 silent interval detection, this needs the get_tick_us callback
+int mb_server_set_baudrate(struct mb_server_context* ctx, uint32_t baudrate) {
+  if (ctx->cb.get_tick_us == NULL) {
+    return -1;
+  }
+  mb_rtu_rx_set_baudrate(&ctx->rx, baudrate);
+  return 0;
+}
+
+void mb_server_rx(struct mb_server_context* ctx, uint8_t b) {  // Interrupt
+  ringbuf_put(&ctx->rx_ring, b);
+}
+
+static void mb_server_receive(struct mb_server_context* ctx) {
+  if (ctx->rx.char_us) {
+    mb_rtu_receive(&ctx->rx, &ctx->rx_ring, ctx->request.data, &ctx->request.pos, ctx->cb.get_tick_us());
+    return;
   }
-  ctx->timeout = ctx->cb.get_tick_ms();
-  if (ctx->request.pos < (sizeof(ctx->request.data) - 1)) {
-    ctx->request.data[ctx->request.pos++] = b;
+
+  // Without silent interval detection, like over USB, only a long pause resets the receiver
+  if (ringbuf_count(&ctx->rx_ring) == 0) {
+    return;
   }
+
+  uint32_t now = ctx->cb.get_tick_ms();
+  if (now - ctx->timeout > MB_SERVER_RECEIVE_TIMEOUT) {
+    mb_reset(ctx);
+  }
+  ctx->timeout = now;
+
+  mb_rtu_receive(&ctx->rx, &ctx->rx_ring, ctx->request.data, &ctx->request.pos, 0);
 }
 
 void mb_server_task(struct mb_server_context* ctx) {
-  switch (mb_check_buf(ctx)) {
+  mb_server_receive(ctx);
+
+  // Check the receiving state, this is only set once a frame is complete
+  switch (ctx->rx.state) {
+    case MB_DATA_INCOMPLETE:
+      break;
     case MB_INVALID_FUNCTION:
-      mb_error(ctx, MB_ERROR_ILLEGAL_FUNCTION);
-      mb_reset(ctx);
-    case MB_INVALID_SERVER_ADDRESS:
+      if (ctx->request.frame.address == ctx->address) {
+        mb_error(ctx, MB_ERROR_ILLEGAL_FUNCTION);
+      }
       mb_reset(ctx);
       break;
-    case MB_ERROR:
     case MB_DATA_READY:
       mb_rx_rtu(ctx);
       mb_reset(ctx);
+      break;
     default:
-    case MB_DATA_INCOMPLETE:
+      mb_reset(ctx);
       break;
   }
 }
@@ -0,0 +1,33 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single producer (interrupt) / single consumer (task) byte ring. Head and tail are free running counters,
+// each written by one side only, the size must be a power of two.
+struct ringbuf {
+  uint8_t* buf;
+  uint32_t mask;
+  uint32_t head;      // Producer
+  uint32_t tail;      // Consumer
+  uint32_t overruns;  // Producer, bytes dropped because the ring was full
+};
+
+int ringbuf_init(struct ringbuf* rb, uint8_t* buf, size_t size);
+
+// Producer
+bool ringbuf_put(struct ringbuf* rb, uint8_t b);
+
+// Consumer
+size_t ringbuf_count(const struct ringbuf* rb);
+bool ringbuf_get(struct ringbuf* rb, uint8_t* b);
+size_t ringbuf_read_span(const struct ringbuf* rb, const uint8_t** data);
+void ringbuf_commit(struct ringbuf* rb, size_t len);
+uint32_t ringbuf_overruns(const struct ringbuf* rb);
+
+// Consumer, for a ring filled by a DMA channel in ring mode
+void ringbuf_dma_sync(struct ringbuf* rb, uint32_t write_index);
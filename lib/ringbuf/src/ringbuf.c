@@ -0,0 +1,77 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#include "ringbuf.h"
+
+int ringbuf_init(struct ringbuf* rb, uint8_t* buf, size_t size) {
+  if (size == 0 || (size & (size - 1)) != 0) {
+    return -1;
+  }
+  rb->buf = buf;
+  rb->mask = size - 1;
+  rb->head = 0;
+  rb->tail = 0;
+  rb->overruns = 0;
+  return 0;
+}
+
+bool ringbuf_put(struct ringbuf* rb, uint8_t b) {
+  uint32_t head = rb->head;
+
+  if (head - __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE) > rb->mask) {
+    // Full, drop the new byte. The tail belongs to the consumer.
+    __atomic_store_n(&rb->overruns, rb->overruns + 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  rb->buf[head & rb->mask] = b;
+  __atomic_store_n(&rb->head, head + 1, __ATOMIC_RELEASE);  // Publish the byte
+  return true;
+}
+
+size_t ringbuf_count(const struct ringbuf* rb) {
+  return __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE) - rb->tail;
+}
+
+bool ringbuf_get(struct ringbuf* rb, uint8_t* b) {
+  const uint8_t* data;
+
+  if (ringbuf_read_span(rb, &data) == 0) {
+    return false;
+  }
+  *b = *data;
+  ringbuf_commit(rb, 1);
+  return true;
+}
+
+// Returns the contiguous readable part of the ring, which stays valid until it is committed.
+size_t ringbuf_read_span(const struct ringbuf* rb, const uint8_t** data) {
+  uint32_t tail = rb->tail;
+  size_t count = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE) - tail;
+  size_t contiguous = rb->mask + 1 - (tail & rb->mask);
+
+  *data = &rb->buf[tail & rb->mask];
+  return count < contiguous ? count : contiguous;
+}
+
+void ringbuf_commit(struct ringbuf* rb, size_t len) {
+  __atomic_store_n(&rb->tail, rb->tail + len, __ATOMIC_RELEASE);  // Hand the space back to the producer
+}
+
+uint32_t ringbuf_overruns(const struct ringbuf* rb) {
+  return __atomic_load_n(&rb->overruns, __ATOMIC_RELAXED);
+}
+
+// The DMA is the producer, so the consumer derives the head from the DMA write position. This must be called at least
+// once per ring size of received bytes, a DMA that laps the ring between two calls can't be detected.
+void ringbuf_dma_sync(struct ringbuf* rb, uint32_t write_index) {
+  uint32_t head = rb->head + ((write_index - rb->head) & rb->mask);
+  uint32_t size = rb->mask + 1;
+
+  if (head - rb->tail > size) {
+    // The DMA overwrote bytes that were not consumed yet, only the last ring size of bytes is still valid
+    rb->overruns += head - rb->tail - size;
+    __atomic_store_n(&rb->tail, head - size, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&rb->head, head, __ATOMIC_RELEASE);
+}
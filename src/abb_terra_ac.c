@@ -1,19 +1,144 @@
 //  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
 //  SPDX-License-Identifier: MIT
 
-#include "modbus_client.h"
+#include "abb_terra_ac.h"
 
-// Support for ABB Terra AC charger
-
-#define ABB_TAC_ADDRESS                    1
+// Registers from the Terra AC wallbox Modbus map, 32-bit values take two registers with the high word first
+#define ABB_TAC_CHARGING_STATE             0x400C  // Two registers, the state is in bits 0-6 of the third byte
+#define ABB_TAC_CHARGING_CURRENT_LIMIT     0x400E
+#define ABB_TAC_CHARGING_CURRENT           0x4010  // L1, L2 and L3
 #define ABB_TAC_SET_CHARGING_CURRENT_LIMIT 0x4100
 
-void limit_charger(struct mb_client_context* ctx, uint16_t current) {
+#define ABB_TAC_LIMIT_TOLERANCE 999    // mA the applied limit may differ from the written one
+#define ABB_TAC_REWRITE_HOLDOFF 10000  // ms before the same limit is written again without an ack or after a mismatch
+
+// The state up to the phase currents in one request
+#define ABB_TAC_POLL_START ABB_TAC_CHARGING_STATE
+#define ABB_TAC_POLL_COUNT (ABB_TAC_CHARGING_CURRENT + 3 * 2 - ABB_TAC_CHARGING_STATE)
+
+void abb_tac_init(struct abb_tac* tac, struct mb_client_context* mb, uint8_t address, uint32_t keepalive,
+                  abb_tac_update_cb_t update) {
+  tac->mb = mb;
+  tac->address = address;
+  tac->update = update;
+  tac->poll_time = 0;
+  tac->state = ABB_TAC_STATE_UNKNOWN;
+  for (int i = 0; i < 3; i++) {
+    tac->current[i] = 0;
+  }
+  tac->keepalive = keepalive;
+  tac->limit = 0;
+  tac->limit_valid = false;
+  tac->limit_time = 0;
+  tac->pending = 0;
+  tac->write_pending = false;
+  tac->write_time = 0;
+  tac->mismatch = false;
+  tac->cap = UINT16_MAX;
+  tac->stats = (struct abb_tac_stats){0};
+}
+
+void abb_tac_set_limit(struct abb_tac* tac, uint16_t current, uint32_t now) {
   if (current > 15650) {  // Somehow the charger is reacting strange when we set it to a higher value. This value causes
                           // the charger to go to 16 amps anyway.
     current = 15650;
   }
 
-  uint32_t value32 = current << 16;  // We only have 16 bits
-  mb_client_write_multiple_registers(ctx, ABB_TAC_ADDRESS, ABB_TAC_SET_CHARGING_CURRENT_LIMIT, (uint16_t*)&value32, 2);
+  if ((tac->write_pending && tac->pending == current && now - tac->write_time < ABB_TAC_REWRITE_HOLDOFF) ||
+      (tac->limit_valid && tac->limit == current && (tac->keepalive == 0 || now - tac->limit_time < tac->keepalive)) ||
+      (tac->mismatch && tac->limit == current && now - tac->limit_time < ABB_TAC_REWRITE_HOLDOFF)) {
+    tac->stats.writes_skipped++;
+    return;
+  }
+
+  uint16_t value[2] = {0, current};  // We only have 16 bits
+  if (mb_client_write_multiple_registers(tac->mb, tac->address, ABB_TAC_SET_CHARGING_CURRENT_LIMIT, value, 2) == 0) {
+    // The shadow follows once the charger acknowledges the write
+    tac->pending = current;
+    tac->write_pending = true;
+    tac->write_time = now;
+    tac->stats.writes_sent++;
+  }
+}
+
+void abb_tac_task(struct abb_tac* tac, uint32_t now) {
+  if (tac->poll_time == 0 || now - tac->poll_time >= ABB_TAC_POLL_INTERVAL) {
+    tac->poll_time = now ? now : 1;
+    mb_client_read_holding_registers(tac->mb, tac->address, ABB_TAC_POLL_START, ABB_TAC_POLL_COUNT);
+  }
+}
+
+static inline uint32_t abb_tac_u32(const uint16_t* data, uint16_t reg) {
+  data += reg - ABB_TAC_POLL_START;
+  return (uint32_t)data[0] << 16 | data[1];
+}
+
+static void abb_tac_poll(struct abb_tac* tac, uint16_t* data) {
+  uint8_t state = (data[ABB_TAC_CHARGING_STATE + 1 - ABB_TAC_POLL_START] >> 8) & 0x7F;
+
+  tac->state = state < ABB_TAC_STATE_OTHER ? state : ABB_TAC_STATE_OTHER;
+  for (int i = 0; i < 3; i++) {
+    tac->current[i] = abb_tac_u32(data, ABB_TAC_CHARGING_CURRENT + i * 2);
+  }
+  if (tac->update) {
+    tac->update(tac);
+  }
+}
+
+void abb_tac_read_holding_registers(struct abb_tac* tac, uint8_t address, uint16_t start, uint16_t count,
+                                    uint16_t* data) {
+  if (address != tac->address) {
+    return;
+  }
+  if (start == ABB_TAC_POLL_START && count == ABB_TAC_POLL_COUNT) {
+    abb_tac_poll(tac, data);
+    return;
+  }
+  if (start != ABB_TAC_CHARGING_CURRENT_LIMIT || count != 2) {
+    return;
+  }
+
+  // A read back from before a newer write tells nothing
+  if (!tac->limit_valid || tac->write_pending) {
+    return;
+  }
+
+  // The charger rounds the limit to whole amps and lowers it to its cable or installation maximum
+  uint32_t applied = (uint32_t)data[0] << 16 | data[1];
+  uint32_t expected = tac->limit < tac->cap ? tac->limit : tac->cap;
+  if (applied + ABB_TAC_LIMIT_TOLERANCE < expected || applied > expected + ABB_TAC_LIMIT_TOLERANCE) {
+    // Write it again after ABB_TAC_REWRITE_HOLDOFF, expecting the applied value as the maximum if it is lower
+    tac->stats.readback_errors++;
+    tac->cap = applied < tac->limit ? applied : UINT16_MAX;
+    tac->limit_valid = false;
+    tac->mismatch = true;
+  }
+}
+
+void abb_tac_status(struct abb_tac* tac, uint8_t address, uint8_t function, uint8_t error_code) {
+  if (address != tac->address) {
+    return;
+  }
+  if (function == MB_READ_HOLDING_REGISTERS && error_code) {
+    tac->state = ABB_TAC_STATE_UNKNOWN;  // The status is no longer fed to the load balancer, which times it out
+    return;
+  }
+  if (function != MB_WRITE_MULTIPLE_REGISTERS) {
+    return;
+  }
+
+  if (!tac->write_pending) {
+    return;
+  }
+  tac->write_pending = false;
+  if (error_code) {  // Also when the request was dropped from the queue
+    tac->limit_valid = false;
+  } else {
+    tac->limit = tac->pending;
+    tac->limit_valid = true;
+    tac->limit_time = tac->write_time;
+    tac->mismatch = false;
+    // Confirm the charger took the limit
+    mb_client_read_holding_registers(tac->mb, tac->address, ABB_TAC_CHARGING_CURRENT_LIMIT, 2);
+  }
 }
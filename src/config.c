@@ -5,21 +5,36 @@
 
 #include <string.h>
 
+#include "abb_terra_ac.h"
 #include "modbus_common.h"  // For CRC16
 
 struct config config;
 
-void config_load(void) {
-  (void)config._crc;
-  memcpy(&config, (void*)(FLASH_CONFIG_OFFSET + FLASH_ROM_OFFSET), sizeof(struct config));
-  if (mb_calc_crc16((uint8_t*)&config, sizeof(struct config))) {
-    config_reset();
-  }
-}
+// The layout before CONFIG_VERSION 1, with the load balancer settings up to the fallback limit
+struct config_v0 {
+  uint8_t address;
+  struct {
+    uint16_t charger_limit;
+    uint8_t number_of_phases;
+    uint16_t alarm_limit;
+    uint8_t alarm_limit_wait_time;
+    uint16_t alarm_limit_change_amount;
+    uint16_t upper_limit;
+    uint8_t upper_limit_wait_time;
+    uint16_t upper_limit_change_amount;
+    uint16_t lower_limit;
+    uint8_t lower_limit_wait_time;
+    uint16_t lower_limit_change_amount;
+    uint16_t fallback_limit;
+    uint8_t fallback_limit_wait_time;
+  } lb_config;
+  uint16_t _crc;
+};
 
-void config_reset(void) {
+static void config_defaults(void) {
   // These are the (factory/my home) defaults
   config.address = 10;
+  config.version = CONFIG_VERSION;
   config.lb_config.charger_limit = 16000;
   config.lb_config.number_of_phases = 3;
   config.lb_config.alarm_limit = 24000;
@@ -33,6 +48,63 @@ void config_reset(void) {
   config.lb_config.lower_limit_change_amount = 1000;
   config.lb_config.fallback_limit = 0;
   config.lb_config.fallback_limit_wait_time = 30;
+  config.lb_config.number_of_chargers = 1;
+  config.lb_config.policy = LB_POLICY_EQUAL;
+  config.lb_config.charger_min_current = 6000;  // Vehicles stop charging below 6 A
+  config.lb_config.trigger = LB_TRIGGER_TIMER;
+  config.lb_config.controller = LB_CONTROLLER_HYSTERESIS;
+  config.lb_config.pi_kp = 100;
+  config.lb_config.pi_ki = 200;
+  config.lb_config.pi_kd = 500;
+  config.lb_config.demand_limit = 0;
+  config.current_source = DSMR_CURRENT_FUSED;
+  config.charger_keepalive = 10;
+  config.restore_limit = 0;
+  for (int i = 0; i < LB_MAX_CHARGERS; i++) {
+    config.lb_config.chargers[i].phase_map = LB_PHASE_MAP_DEFAULT;
+    config.lb_config.chargers[i].priority = 0;
+    config.charger_address[i] = ABB_TAC_ADDRESS + i;
+  }
+}
+
+// Keeps the settings of a version 0 config, the ones added since get their default
+static void config_migrate_v0(const struct config_v0* v0) {
+  config.address = v0->address;
+  config.lb_config.charger_limit = v0->lb_config.charger_limit;
+  config.lb_config.number_of_phases = v0->lb_config.number_of_phases;
+  config.lb_config.alarm_limit = v0->lb_config.alarm_limit;
+  config.lb_config.alarm_limit_wait_time = v0->lb_config.alarm_limit_wait_time;
+  config.lb_config.alarm_limit_change_amount = v0->lb_config.alarm_limit_change_amount;
+  config.lb_config.upper_limit = v0->lb_config.upper_limit;
+  config.lb_config.upper_limit_wait_time = v0->lb_config.upper_limit_wait_time;
+  config.lb_config.upper_limit_change_amount = v0->lb_config.upper_limit_change_amount;
+  config.lb_config.lower_limit = v0->lb_config.lower_limit;
+  config.lb_config.lower_limit_wait_time = v0->lb_config.lower_limit_wait_time;
+  config.lb_config.lower_limit_change_amount = v0->lb_config.lower_limit_change_amount;
+  config.lb_config.fallback_limit = v0->lb_config.fallback_limit;
+  config.lb_config.fallback_limit_wait_time = v0->lb_config.fallback_limit_wait_time;
+}
+
+void config_load(void) {
+  const uint8_t* flash = (const uint8_t*)(FLASH_CONFIG_OFFSET + FLASH_ROM_OFFSET);
+  struct config_v0 v0;
+
+  (void)config._crc;
+  memcpy(&config, flash, sizeof(struct config));
+  if (!mb_calc_crc16((uint8_t*)&config, sizeof(struct config)) && config.version == CONFIG_VERSION) {
+    return;
+  }
+
+  memcpy(&v0, flash, sizeof(struct config_v0));
+  config_defaults();
+  if (!mb_calc_crc16((uint8_t*)&v0, sizeof(struct config_v0))) {
+    config_migrate_v0(&v0);
+  }
+  config_save();
+}
+
+void config_reset(void) {
+  config_defaults();
   config_save();
 }
 
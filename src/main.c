@@ -9,6 +9,7 @@
 #include <pico/stdlib.h>
 #include <stdio.h>
 
+#include "abb_terra_ac.h"
 #include "bsp/board.h"
 #include "config.h"
 #include "dsmr.h"
@@ -16,7 +17,9 @@
 #include "modbus_client.h"
 #include "modbus_server.h"
 #include "registers.h"
+#include "rs485.h"
 #include "tusb.h"
+#include "uart_dma.h"
 
 #define DSMR_UART      uart0
 #define DSMR_UART_IRQ  UART0_IRQ
@@ -31,34 +34,60 @@
 #define USB_ITF_DSMR   0
 #define USB_ITF_MB     1
 
+// The last good limit is kept in watchdog scratch registers, which survive a reset but not a power cycle
+#define LB_SCRATCH       0  // LB_SCRATCH_MAGIC when LB_SCRATCH_LIMIT holds a limit
+#define LB_SCRATCH_LIMIT 1
+#define LB_SCRATCH_MAGIC 0x4C42494D
+
 static struct mb_server_context mb_server_ctx;
 static struct mb_client_context mb_client_ctx;
+static struct lb_context lb_ctx;
 static uint16_t system_error = 0;
-
-void limit_charger(struct mb_client_context* ctx, uint16_t current);
-
-static void lb_limit_charger(uint16_t current) {
-  limit_charger(&mb_client_ctx, current);
-}
+static uint16_t mb_inputs[MB_INPUT_COUNT];  // Input registers from MB_INPUT_FIRST, written once per telegram
+static uint32_t telegram_time;  // ms, when mb_inputs was written
+static struct rs485 rs485;
+static struct abb_tac chargers[LB_MAX_CHARGERS];
+#if UART_RX_DMA
+static struct uart_dma_rx dsmr_dma;
+static struct uart_dma_rx mb_dma;
+#endif
 
 static void mb_client_tx(uint8_t* data, size_t size) {
-  gpio_put(MB_DE_PIN, 1);
-
-  uart_write_blocking(MB_UART, data, size);
+  rs485_tx(&rs485, data, size);
+}
 
-  // Wait until fifo is drained so we now when to turn off the driver enable pin.
-  uart_tx_wait_blocking(MB_UART);
-  gpio_put(MB_DE_PIN, 0);
+static void on_mb_tx_done(void) {  // Interrupt
+  mb_client_tx_done(&mb_client_ctx);
 }
 
 static void on_mb_rx(void) {  // Interrupt
-  mb_client_rx(&mb_client_ctx, uart_getc(MB_UART));
+  while (uart_is_readable(MB_UART)) {
+    mb_client_rx(&mb_client_ctx, uart_getc(MB_UART));
+  }
 }
 
 static uint32_t mb_get_tick_ms(void) {
   return time_us_64() / 1000;
 }
 
+static uint32_t mb_get_tick_us(void) {
+  return time_us_32();
+}
+
+static void lb_limit_charger(struct lb_context* ctx, uint8_t charger, uint16_t current) {
+  (void)ctx;
+  abb_tac_set_limit(&chargers[charger], current, mb_get_tick_ms());
+}
+
+static void charger_update(const struct abb_tac* tac) {
+  uint8_t charger = tac - chargers;
+
+  lb_set_charger_active(&lb_ctx, charger, tac->state != ABB_TAC_STATE_IDLE);
+  for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+    lb_set_charger_current(&lb_ctx, charger, phase, tac->current[phase]);
+  }
+}
+
 static void on_dsmr_rx(void) {  // Interrupt
   while (uart_is_readable(DSMR_UART)) {
     dsmr_rx(uart_getc(DSMR_UART));
@@ -90,123 +119,220 @@ void tud_cdc_rx_cb(uint8_t i) {  // Interrupt
   }
 }
 
-static void dsmr_update(enum dsmr_msg obj, float value) {
-  int int_value = (int)value;
-  switch (obj) {
-    case MSG_CURRENT_L1:
-      lb_set_grid_current(LB_PHASE_1, int_value * 1000);
-      break;
-    case MSG_CURRENT_L2:
-      lb_set_grid_current(LB_PHASE_2, int_value * 1000);
-      break;
-    case MSG_CURRENT_L3:
-      lb_set_grid_current(LB_PHASE_3, int_value * 1000);
-      break;
-    default:
-      break;
+static void set_input32(uint16_t address, uint32_t value) {
+  mb_inputs[address - MB_INPUT_FIRST] = value >> 16;
+  mb_inputs[address - MB_INPUT_FIRST + 1] = value & 0xFFFF;
+}
+
+static void update_inputs(const struct dsmr_telegram* telegram) {
+  set_input32(MB_INPUT_METER_SEQUENCE, telegram->sequence);
+  mb_inputs[MB_INPUT_METER_PRESENT - MB_INPUT_FIRST] = telegram->present;
+  for (enum dsmr_msg msg = 0; msg < MSG_LAST; msg++) {
+    set_input32(MB_INPUT_VALUE(msg), telegram->present & (1UL << msg) ? telegram->values[msg] : 0);
+  }
+  telegram_time = mb_get_tick_ms();
+}
+
+static void dsmr_update(const struct dsmr_telegram* telegram) {
+  int32_t current;  // mA, negative when returning power
+  int32_t power;  // W
+  bool updated = false;
+
+  // Only called for a complete telegram with a valid CRC, so all phases are from the same measurement
+  update_inputs(telegram);
+  for (enum lb_phase phase = LB_PHASE_1; phase <= LB_PHASE_3; phase++) {
+    if (!dsmr_phase_current(telegram, phase, config.current_source, &current)) {
+      lb_set_grid_current(&lb_ctx, phase, current);
+      updated = true;
+    }
+    if (!dsmr_phase_power(telegram, phase, &power)) {
+      lb_set_grid_power(&lb_ctx, phase, power);
+    }
+  }
+  if (updated) {
+    lb_commit_grid_current(&lb_ctx, mb_get_tick_ms());
+  }
+}
+
+static void mb_client_holding_registers(uint8_t address, uint16_t start, uint16_t count, uint16_t* data) {
+  for (int i = 0; i < lb_ctx.config.number_of_chargers; i++) {
+    abb_tac_read_holding_registers(&chargers[i], address, start, count, data);
   }
 }
 
 static void mb_client_status(uint8_t address, uint8_t function, uint8_t error_) {
-  (void)address;
-  (void)function;
+  for (int i = 0; i < lb_ctx.config.number_of_chargers; i++) {
+    abb_tac_status(&chargers[i], address, function, error_);
+  }
   system_error |= error_ & 0xFF;
 }
 
+static void lb_save_limit(void) {
+  enum lb_state state = lb_get_state(&lb_ctx);
+
+  if (state != LB_STATE_ALARM_LIMIT && state != LB_STATE_FALLBACK) {
+    watchdog_hw->scratch[LB_SCRATCH_LIMIT] = lb_get_limit(&lb_ctx);
+    watchdog_hw->scratch[LB_SCRATCH] = LB_SCRATCH_MAGIC;
+  }
+}
+
+static void lb_restore_limit(void) {
+  if (config.restore_limit && watchdog_hw->scratch[LB_SCRATCH] == LB_SCRATCH_MAGIC) {
+    lb_set_start_limit(&lb_ctx, watchdog_hw->scratch[LB_SCRATCH_LIMIT]);
+  }
+}
+
 static void sys_reset(void) {
   scb_hw->aircr |= M0PLUS_AIRCR_SYSRESETREQ_BITS;
   for (;;) {
   }
 }
 
-static enum mb_result write_single_holding_register(uint16_t reg, uint16_t value) {
-  switch (reg) {
-    case MB_REG_CHARGER_LIMIT_OVERRIDE:
-      lb_set_charger_limit_override(value);
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_CHARGER_LIMIT:
-      config.lb_config.charger_limit = value;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_NUMBER_OF_PHASES:
-      if (value < 1 || value > 3) {
-        return MB_ERROR_ILLEGAL_DATA_VALUE;
-      }
-      config.lb_config.number_of_phases = value & 0xF;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_ALARM_LIMIT:
-      config.lb_config.alarm_limit = value;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_ALARM_LIMIT_WAIT_TIME:
-      if (value >= 0xFF) {
-        return MB_ERROR_ILLEGAL_DATA_VALUE;
-      }
-      config.lb_config.alarm_limit_wait_time = value & 0xFF;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_ALARM_LIMIT_CHANGE_AMOUNT:
-      config.lb_config.alarm_limit_change_amount = value;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_UPPER_LIMIT:
-      config.lb_config.upper_limit = value;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_UPPER_LIMIT_WAIT_TIME:
-      if (value >= 0xFF) {
-        return MB_ERROR_ILLEGAL_DATA_VALUE;
-      }
-      config.lb_config.upper_limit_wait_time = value & 0xFF;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_UPPER_LIMIT_CHANGE_AMOUNT:
-      config.lb_config.upper_limit_change_amount = value;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_LOWER_LIMIT:
-      config.lb_config.lower_limit = value;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_LOWER_LIMIT_WAIT_TIME:
-      if (value >= 0xFF) {
-        return MB_ERROR_ILLEGAL_DATA_VALUE;
-      }
-      config.lb_config.lower_limit_wait_time = value & 0xFF;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_LOWER_LIMIT_CHANGE_AMOUNT:
-      config.lb_config.lower_limit_change_amount = value;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_FALLBACK_LIMIT:
-      config.lb_config.fallback_limit = value;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_FALLBACK_LIMIT_WAIT_TIME:
-      if (value >= 0xFF) {
-        return MB_ERROR_ILLEGAL_DATA_VALUE;
-      }
-      config.lb_config.fallback_limit_wait_time = value & 0xFF;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_ADDRESS:
-      if (value >= 0xFF) {
-        return MB_ERROR_ILLEGAL_DATA_VALUE;
-      }
-      config.address = value & 0xFF;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_APPLY:
-      if (value == 1) {
-        config_save();
-        sys_reset();
-      }
-      return MB_ERROR_ILLEGAL_DATA_VALUE;
-    case MB_REG_CONFIG_FACTORY_RESET:
-      if (value == 1) {
-        config_reset();
-        sys_reset();
-        return MB_NO_ERROR;
-      }
-      return MB_ERROR_ILLEGAL_DATA_VALUE;
+static uint16_t get_limit_override(uint8_t index) {
+  (void)index;
+  return lb_get_charger_limit_override(&lb_ctx);
+}
+
+static enum mb_result set_limit_override(uint8_t index, uint16_t value) {
+  (void)index;
+  lb_set_charger_limit_override(&lb_ctx, value);
+  return MB_NO_ERROR;
+}
+
+static uint16_t get_current_limit(uint8_t index) {
+  (void)index;
+  return MIN(lb_get_limit(&lb_ctx), 0xFFFF);
+}
+
+static uint16_t get_lb_state(uint8_t index) {
+  (void)index;
+  return lb_get_state(&lb_ctx);
+}
+
+static uint16_t get_charger_state(uint8_t charger) {
+  return chargers[charger].state;
+}
+
+static uint16_t get_charger_current(uint8_t index) {  // MB_INDEX(charger, phase)
+  return MIN(chargers[index / 4].current[index % 4], 0xFFFF);
+}
+
+static uint16_t get_charger_limit(uint8_t charger) {
+  return lb_get_charger_limit(&lb_ctx, charger);
+}
+
+// Summed over the chargers: writes sent (0), skipped (1) and readback errors (2)
+static uint16_t get_charger_stat(uint8_t index) {
+  uint32_t sum = 0;
+
+  for (int i = 0; i < lb_ctx.config.number_of_chargers; i++) {
+    const struct abb_tac_stats* stats = &chargers[i].stats;
+    sum += index == 0 ? stats->writes_sent : index == 1 ? stats->writes_skipped : stats->readback_errors;
+  }
+  return MIN(sum, 0xFFFF);
+}
+
+static uint16_t get_ramp_time(uint8_t index) {
+  (void)index;
+  return MIN(lb_get_ramp_time(&lb_ctx) / 100, 0xFFFF);
+}
+
+static uint16_t get_average_power(uint8_t index) {  // MB_INDEX(window, phase), signed, saturated to 16 bits
+  int32_t power = lb_get_average_power(&lb_ctx, index / 4, index % 4);
+
+  return (int16_t)(power < INT16_MIN ? INT16_MIN : power > INT16_MAX ? INT16_MAX : power);
+}
+
+static enum mb_result set_config_apply(uint8_t index, uint16_t value) {
+  (void)index;
+  (void)value;
+  config_save();
+  sys_reset();
+  return MB_NO_ERROR;
+}
+
+static enum mb_result set_factory_reset(uint8_t index, uint16_t value) {
+  (void)index;
+  (void)value;
+  config_reset();
+  sys_reset();
+  return MB_NO_ERROR;
+}
+
+// Indexed by address, so a request is one bounds check and a loop over its registers
+#define MB_REG_TABLE(name, address, access_, type, min_, max_, backing, ...) \
+  MB_REG_TABLE_##type(address, access_, min_, max_, backing)
+// The backing arrives as its fields, a U32 register takes the next address for the low word
+#define MB_REG_ENTRY(address, access_, min_, max_, ...) \
+  [(address)-MB_REG_FIRST] = {.access = MB_ACCESS_##access_, .min = (min_), .max = (max_), __VA_ARGS__},
+#define MB_REG_TABLE_U16 MB_REG_ENTRY
+#define MB_REG_TABLE_S16 MB_REG_ENTRY
+#define MB_REG_TABLE_U32(address, access_, min_, max_, ...)          \
+  MB_REG_ENTRY(address, access_, min_, max_, __VA_ARGS__, .word = 1) \
+  MB_REG_ENTRY((address) + 1, access_, min_, max_, __VA_ARGS__, .word = 2)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const struct mb_register mb_registers[MB_REG_COUNT] = {
+    MB_REGISTERS(MB_REG_TABLE)
+    MB_CHARGERS(MB_REG_TABLE)
+};
+#pragma GCC diagnostic pop
+
+static const struct mb_register* get_registers(uint16_t start, uint16_t count) {
+  if (start < MB_REG_FIRST || start - MB_REG_FIRST + count > MB_REG_COUNT) {
+    return NULL;
+  }
+  return &mb_registers[start - MB_REG_FIRST];
+}
+
+static uint16_t read_register(const struct mb_register* reg) {
+  if (reg->get) {
+    return reg->get(reg->index);
+  }
+  switch (reg->size) {
+    case 1:
+      return *(uint8_t*)reg->field;
+    case 2:
+      return *(uint16_t*)reg->field;
     default:
-      return MB_ERROR_ILLEGAL_DATA_ADDRESS;
+      if (reg->word) {
+        return reg->word == 1 ? *(uint32_t*)reg->field >> 16 : *(uint32_t*)reg->field & 0xFFFF;
+      }
+      return MIN(*(uint32_t*)reg->field, 0xFFFF);
   }
 }
 
+static enum mb_result write_register(const struct mb_register* reg, uint16_t value) {
+  if (reg->set) {
+    return reg->set(reg->index, value);
+  }
+  if (reg->size == 1) {
+    *(uint8_t*)reg->field = value;
+  } else {
+    *(uint16_t*)reg->field = value;
+  }
+  return MB_NO_ERROR;
+}
+
+// All registers are checked before the first one is written
 static enum mb_result write_holding_registers(uint16_t start, uint16_t* data, uint16_t count) {
+  const struct mb_register* regs = get_registers(start, count);
   enum mb_result res;
 
+  if (!regs) {
+    return MB_ERROR_ILLEGAL_DATA_ADDRESS;
+  }
   for (int i = 0; i < count; i++) {
-    res = write_single_holding_register(start + i, data[i]);
+    if (!(regs[i].access & MB_ACCESS_W)) {
+      return MB_ERROR_ILLEGAL_DATA_ADDRESS;
+    }
+    if (data[i] < regs[i].min || data[i] > regs[i].max) {
+      return MB_ERROR_ILLEGAL_DATA_VALUE;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    res = write_register(&regs[i], data[i]);
     if (res != MB_NO_ERROR) {
       return res;
     }
@@ -214,73 +340,38 @@ static enum mb_result write_holding_registers(uint16_t start, uint16_t* data, ui
   return MB_NO_ERROR;
 }
 
-static enum mb_result read_single_holding_register(uint16_t reg, uint16_t* value) {
-  switch (reg) {
-    case MB_REG_CHARGER_LIMIT_OVERRIDE:
-      *value = lb_get_charger_limit_override();
-      return MB_NO_ERROR;
-    case MB_REG_CURRENT_LIMIT:
-      *value = lb_get_limit();
-      return MB_NO_ERROR;
-    case MB_REG_ERROR:
-      *value = system_error;
-      return MB_NO_ERROR;
-    case MB_REG_LB_STATE:
-      *value = lb_get_state();
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_CHARGER_LIMIT:
-      *value = config.lb_config.charger_limit;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_NUMBER_OF_PHASES:
-      *value = config.lb_config.number_of_phases;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_ALARM_LIMIT:
-      *value = config.lb_config.alarm_limit;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_ALARM_LIMIT_WAIT_TIME:
-      *value = config.lb_config.alarm_limit_wait_time;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_ALARM_LIMIT_CHANGE_AMOUNT:
-      *value = config.lb_config.alarm_limit_change_amount;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_UPPER_LIMIT:
-      *value = config.lb_config.upper_limit;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_UPPER_LIMIT_WAIT_TIME:
-      *value = config.lb_config.upper_limit_wait_time;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_UPPER_LIMIT_CHANGE_AMOUNT:
-      *value = config.lb_config.upper_limit_change_amount;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_LOWER_LIMIT:
-      *value = config.lb_config.lower_limit;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_LOWER_LIMIT_WAIT_TIME:
-      *value = config.lb_config.lower_limit_wait_time;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_LOWER_LIMIT_CHANGE_AMOUNT:
-      *value = config.lb_config.lower_limit_change_amount;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_FALLBACK_LIMIT:
-      *value = config.lb_config.fallback_limit;
-      return MB_NO_ERROR;
-    case MB_REG_CONFIG_FALLBACK_LIMIT_WAIT_TIME:
-      *value = config.lb_config.fallback_limit_wait_time;
-      return MB_NO_ERROR;
-    default:
-      return MB_ERROR_ILLEGAL_DATA_ADDRESS;
-  }
+static enum mb_result write_single_holding_register(uint16_t reg, uint16_t value) {
+  return write_holding_registers(reg, &value, 1);
 }
 
 static enum mb_result read_holding_registers(uint16_t start, uint16_t count) {
-  uint16_t val;
+  const struct mb_register* regs = get_registers(start, count);
+
+  if (!regs) {
+    return MB_ERROR_ILLEGAL_DATA_ADDRESS;
+  }
   for (int i = 0; i < count; i++) {
-    if (read_single_holding_register(start + i, &val) == MB_NO_ERROR) {
-      mb_server_add_response(&mb_server_ctx, val);
-    } else {
+    if (!(regs[i].access & MB_ACCESS_R)) {
       return MB_ERROR_ILLEGAL_DATA_ADDRESS;
     }
   }
+  for (int i = 0; i < count; i++) {
+    mb_server_add_response(&mb_server_ctx, read_register(&regs[i]));
+  }
+  return MB_NO_ERROR;
+}
+
+// Served from the copy of the last telegram, so all registers of one read are from the same telegram
+static enum mb_result read_input_registers(uint16_t start, uint16_t count) {
+  uint16_t* age = &mb_inputs[MB_INPUT_METER_AGE - MB_INPUT_FIRST];
+
+  if (start < MB_INPUT_FIRST || start - MB_INPUT_FIRST + count > MB_INPUT_COUNT) {
+    return MB_ERROR_ILLEGAL_DATA_ADDRESS;
+  }
+  *age = dsmr_get_telegram()->sequence ? MIN((mb_get_tick_ms() - telegram_time) / 100, 0xFFFF) : 0xFFFF;
+  for (int i = 0; i < count; i++) {
+    mb_server_add_response(&mb_server_ctx, mb_inputs[start - MB_INPUT_FIRST + i]);
+  }
   return MB_NO_ERROR;
 }
 
@@ -289,7 +380,7 @@ static void led_task() {
   static absolute_time_t led_timer;
   static int pulse_counter = 0;
 
-  uint8_t led_pulse_mode = lb_get_state();
+  uint8_t led_pulse_mode = lb_get_state(&lb_ctx);
 
   if (absolute_time_diff_us(led_timer, get_absolute_time()) > 0) {
     if (pulse_counter == 0) {
@@ -313,12 +404,9 @@ static void mb_client_tx_request(uint8_t* data, size_t size) {
 }
 
 static void setup_uarts(void) {
-  gpio_init(MB_DE_PIN);
-  gpio_set_dir(MB_DE_PIN, GPIO_OUT);
-  gpio_put(MB_DE_PIN, 0);
-
   uart_init(DSMR_UART, DSMR_UART_BAUD);
   uart_init(MB_UART, MB_UART_BAUD);
+  rs485_init(&rs485, MB_UART, MB_DE_PIN, MB_UART_BAUD, on_mb_tx_done);
 
   gpio_set_function(DSMR_RX_PIN, GPIO_FUNC_UART);
   gpio_set_function(MB_TX_PIN, GPIO_FUNC_UART);
@@ -327,7 +415,10 @@ static void setup_uarts(void) {
   gpio_pull_down(MB_RX_PIN);
   gpio_pull_down(DSMR_RX_PIN);
 
-  uart_set_fifo_enabled(DSMR_UART, false);
+#if !UART_RX_DMA
+  // With the FIFO the interrupt fires at the FIFO level or after 32 bit periods without new bytes. Modbus needs every
+  // byte when it arrives for the silent interval detection.
+  uart_set_fifo_enabled(DSMR_UART, true);
   uart_set_fifo_enabled(MB_UART, false);
 
   irq_set_exclusive_handler(DSMR_UART_IRQ, on_dsmr_rx);
@@ -337,6 +428,15 @@ static void setup_uarts(void) {
 
   uart_set_irq_enables(DSMR_UART, true, false);
   uart_set_irq_enables(MB_UART, true, false);
+#endif
+}
+
+static void setup_uart_dma(void) {
+#if UART_RX_DMA
+  // The rings are owned by the libraries, so this must follow their init
+  uart_dma_rx_init(&dsmr_dma, DSMR_UART, dsmr_rx_ring());
+  uart_dma_rx_init(&mb_dma, MB_UART, &mb_client_ctx.rx_ring);
+#endif
 }
 
 int main(void) {
@@ -356,15 +456,21 @@ int main(void) {
 
   config_load();
 
-  lb_init(&config.lb_config, lb_limit_charger);
+  lb_init(&lb_ctx, &config.lb_config, lb_limit_charger);
+  lb_restore_limit();
 
-  dsmr_init(dsmr_update, dsmr_forward);
+  struct dsmr_cb dsmr_cb = {
+      .telegram = dsmr_update,
+      .forward = dsmr_forward,
+  };
+  dsmr_init(&dsmr_cb);
 
   struct mb_server_cb server_cb = {
       .get_tick_ms = mb_get_tick_ms,
       .tx = mb_server_tx,
       .write_single_register = write_single_holding_register,
       .read_holding_registers = read_holding_registers,
+      .read_input_registers = read_input_registers,
       .write_multiple_registers = write_holding_registers,
       .raw_rx = mb_client_tx_request,
   };
@@ -372,11 +478,20 @@ int main(void) {
 
   struct mb_client_cb client_cb = {
       .get_tick_ms = mb_get_tick_ms,
-      .tx = mb_client_tx,
+      .get_tick_us = mb_get_tick_us,
+      .tx_start = mb_client_tx,
+      .read_holding_registers = mb_client_holding_registers,
       .status = mb_client_status,
       .raw_rx = mb_server_tx,
   };
   mb_client_init(&mb_client_ctx, &client_cb);
+  mb_client_set_baudrate(&mb_client_ctx, MB_UART_BAUD);
+  for (int i = 0; i < lb_ctx.config.number_of_chargers; i++) {
+    abb_tac_init(&chargers[i], &mb_client_ctx, config.charger_address[i], config.charger_keepalive * 1000,
+                 charger_update);
+  }
+
+  setup_uart_dma();
 
   printf("# P1 Load balancing modbus controller\r\n");
 
@@ -384,10 +499,18 @@ int main(void) {
 #pragma ide diagnostic ignored "EndlessLoop"
   for (;;) {
     tud_task();
+#if UART_RX_DMA
+    uart_dma_rx_poll(&dsmr_dma);
+    uart_dma_rx_poll(&mb_dma);
+#endif
     dsmr_task();
     mb_server_task(&mb_server_ctx);
     mb_client_task(&mb_client_ctx);
-    lb_task(mb_get_tick_ms());
+    for (int i = 0; i < lb_ctx.config.number_of_chargers; i++) {
+      abb_tac_task(&chargers[i], mb_get_tick_ms());
+    }
+    lb_task(&lb_ctx, mb_get_tick_ms());
+    lb_save_limit();
     led_task();
     watchdog_update();
   }
@@ -0,0 +1,59 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#include "rs485.h"
+
+#include <hardware/dma.h>
+#include <hardware/gpio.h>
+
+#define RS485_CHAR_BITS 10  // 8N1
+
+void rs485_init(struct rs485* rs, uart_inst_t* uart, uint de_pin, uint baudrate, void (*tx_done)(void)) {
+  rs->uart = uart;
+  rs->de_pin = de_pin;
+  rs->baudrate = baudrate;
+  rs->bit_us = (1000000 + baudrate - 1) / baudrate;
+  rs->alarm = 0;
+  rs->tx_done = tx_done;
+  rs->channel = dma_claim_unused_channel(true);
+
+  dma_channel_config c = dma_channel_get_default_config(rs->channel);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_read_increment(&c, true);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_dreq(&c, uart_get_dreq(uart, true));
+  dma_channel_configure(rs->channel, &c, &uart_get_hw(uart)->dr, NULL, 0, false);
+
+  gpio_init(de_pin);
+  gpio_set_dir(de_pin, GPIO_OUT);
+  gpio_put(de_pin, 0);
+}
+
+static int64_t rs485_tx_check(alarm_id_t id, void* user_data) {  // Interrupt
+  struct rs485* rs = user_data;
+  (void)id;
+
+  // The DMA or the FIFO may still hold bytes when the alarm was late, otherwise this is only the last stop bit
+  if (dma_channel_is_busy(rs->channel) || (uart_get_hw(rs->uart)->fr & UART_UARTFR_BUSY_BITS)) {
+    return -(int64_t)rs->bit_us;  // Again one bit time after this one was scheduled
+  }
+
+  gpio_put(rs->de_pin, 0);
+  rs->alarm = 0;
+  rs->tx_done();
+  return 0;
+}
+
+void rs485_tx(struct rs485* rs, const uint8_t* data, size_t len) {
+  if (rs->alarm) {
+    // Still sending the previous frame, which was given up on
+    cancel_alarm(rs->alarm);
+    dma_channel_abort(rs->channel);
+  }
+
+  gpio_put(rs->de_pin, 1);
+  dma_channel_transfer_from_buffer_now(rs->channel, data, len);
+
+  // The UART is busy for exactly the length of the frame, check it right at the end
+  rs->alarm = add_alarm_in_us((uint64_t)len * RS485_CHAR_BITS * 1000000 / rs->baudrate, rs485_tx_check, rs, true);
+}
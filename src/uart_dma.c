@@ -0,0 +1,35 @@
+//  SPDX-FileCopyrightText: 2022 Tim Stegeman <tim.stegeman@gmail.com>
+//  SPDX-License-Identifier: MIT
+
+#include "uart_dma.h"
+
+#include <hardware/dma.h>
+
+void uart_dma_rx_init(struct uart_dma_rx* rx, uart_inst_t* uart, struct ringbuf* ring) {
+  rx->uart = uart;
+  rx->ring = ring;
+  rx->channel = dma_claim_unused_channel(true);
+
+  hard_assert(((uintptr_t)ring->buf & ring->mask) == 0);
+
+  dma_channel_config c = dma_channel_get_default_config(rx->channel);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, true);
+  channel_config_set_ring(&c, true, __builtin_ctz(ring->mask + 1));  // Wrap the write address
+  channel_config_set_dreq(&c, uart_get_dreq(uart, false));
+
+  uart_set_fifo_enabled(uart, true);
+  dma_channel_configure(rx->channel, &c, ring->buf, &uart_get_hw(uart)->dr, UINT32_MAX, true);
+}
+
+void uart_dma_rx_poll(struct uart_dma_rx* rx) {
+  uint32_t write_index = dma_channel_hw_addr(rx->channel)->write_addr - (uintptr_t)rx->ring->buf;
+
+  ringbuf_dma_sync(rx->ring, write_index);
+
+  // The transfer count runs out after 4G bytes, restart it. Meanwhile the UART FIFO holds the received bytes.
+  if (!dma_channel_is_busy(rx->channel)) {
+    dma_channel_set_trans_count(rx->channel, UINT32_MAX, true);
+  }
+}
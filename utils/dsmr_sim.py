@@ -45,15 +45,31 @@ TELEGRAM = '''
 0-1:24.1.0(003)
 0-1:96.1.0(4730303539303033383434303238393139)
 0-1:24.2.1(230107170500W)(03133.361*m3)
-!824A
+!
 '''
 
+
+def crc16(data):
+    # CRC16/ARC over everything from '/' up to and including '!'
+    crc = 0
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+    return crc
+
+
+def encode(telegram):
+    data = b"".join(line.strip().encode('US-ASCII') + b"\r\n" for line in telegram.strip().splitlines())
+    data = data[:data.rindex(b"!") + 1]
+    return data + b"%04X\r\n" % crc16(data)
+
+
 with serial.Serial(PORT, BAUD_RATE) as ser:
     i = 0
     current = 5
     while True:
         i = i + 1
         print("Sending telegram", i, end='\r')
-        for line in TELEGRAM.splitlines():
-            ser.write(line.strip().encode('US-ASCII') + b"\r\n")
+        ser.write(encode(TELEGRAM))
         time.sleep(INTERVAL)